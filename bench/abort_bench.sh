@@ -0,0 +1,34 @@
+#!/bin/bash
+# Throughput of abort-heavy workloads with 2PL updating the accounts in place, where an abort rolls every
+# change back and erases the accounts the transaction created, against deferred updates, where it drops the
+# workspace. txn/s counts every transaction that finished, committed or aborted. Checks first that OCC and
+# deferred updates are refused together.
+# usage: bench/abort_bench.sh [clients] [transactions per client]
+source "$(dirname "$0")/cluster.sh"
+CLIENTS=${1:-4}
+TXNS=${2:-200}
+
+# deferred updates are a 2PL variant: a server asked to run them under OCC has to refuse to start
+for invalid in occ,deferred deferred,occ; do
+    if ! timeout 2 "$BUILD/server" A "$CONFIG" $invalid 2>&1 | grep -q "cannot be combined"; then
+        echo "server accepted the invalid options $invalid"
+        exit 1
+    fi
+done
+
+echo "clients: $CLIENTS, transactions per client: $TXNS"
+printf "%-9s %8s %8s %10s %8s %10s\n" mode aborts txn/s committed aborted timed-out
+for abort_percent in 0 50 90; do
+    for mode in in-place deferred; do
+        options=wound-wait
+        [ $mode = deferred ] && options=deferred,wound-wait
+        start_cluster $options
+        seed_accounts 100
+        start=$(date +%s.%N)
+        read -r rate committed aborted timed_out <<< "$(run_clients "$CLIENTS" 300 aborting "$TXNS" $abort_percent)"
+        end=$(date +%s.%N)
+        rate=$(python3 -c "print('%.0f' % (($committed + $aborted) / ($end - $start)))")
+        printf "%-9s %7s%% %8s %10s %8s %10s\n" $mode $abort_percent $rate $committed $aborted $timed_out
+        stop_cluster
+    done
+done
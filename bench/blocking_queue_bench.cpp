@@ -0,0 +1,115 @@
+// Enqueue-to-dequeue latency of the request queue: producers push timestamps with a pause between pushes, as
+// I/O threads do with the RPCs of a client, and one consumer takes them. Compares BlockingQueue with the
+// busy-polling deque the handler threads used to spin on, and reports the consumer's CPU use alongside.
+// usage: blocking_queue_bench [max_producers] [pushes_per_producer] [pause_us]
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include "../common/blocking_queue.hpp"
+
+using namespace std;
+typedef chrono::steady_clock::time_point Stamp;
+
+// the handler loop before BlockingQueue: check empty() under a lock, sleep(0.001) (which is sleep(0)) if so
+class BusyPollQueue {
+    private:
+        deque<Stamp> items;
+        mutex mx;
+        bool closed = false;
+    public:
+        void push(Stamp item) {
+            lock_guard<mutex> lock(mx);
+            items.push_back(item);
+        }
+
+        bool pop(Stamp &item) {
+            while(true){
+                {
+                    lock_guard<mutex> lock(mx);
+                    if(!items.empty()){
+                        item = items.front();
+                        items.pop_front();
+                        return true;
+                    }
+                    if(closed)
+                        return false;
+                }
+                sleep(0.001);
+            }
+        }
+
+        void close() {
+            lock_guard<mutex> lock(mx);
+            closed = true;
+        }
+};
+
+double thread_cpu_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Result {
+    double p50_us, p99_us, max_us, consumer_cpu;
+};
+
+template <typename Queue>
+Result run(int producers, int pushes, int pause_us) {
+    Queue queue;
+    vector<double> latencies;
+    latencies.reserve((size_t) producers * pushes);
+    double cpu = 0;
+    thread consumer([&]() {
+        double cpu_start = thread_cpu_seconds();
+        Stamp sent;
+        while(queue.pop(sent))
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+        cpu = thread_cpu_seconds() - cpu_start;
+    });
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for(int p = 0; p < producers; ++p){
+        workers.emplace_back([&]() {
+            for(int i = 0; i < pushes; ++i){
+                queue.push(chrono::steady_clock::now());
+                this_thread::sleep_for(chrono::microseconds(pause_us));
+            }
+        });
+    }
+    for(auto &w: workers) w.join();
+    queue.close();
+    consumer.join();
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    sort(latencies.begin(), latencies.end());
+    return Result{latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back(), cpu / wall};
+}
+
+void print(const char *name, int producers, const Result &r) {
+    cout << fixed << setprecision(1) << setw(12) << name << setw(10) << producers << setw(10) << r.p50_us
+         << setw(10) << r.p99_us << setw(12) << r.max_us << setw(10) << r.consumer_cpu * 100 << endl;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_producers = argc > 1 ? atoi(argv[1]) : 4;
+    int pushes = argc > 2 ? atoi(argv[2]) : 20000;
+    int pause_us = argc > 3 ? atoi(argv[3]) : 50;
+    cout << "cores: " << thread::hardware_concurrency() << ", pushes per producer: " << pushes
+         << ", pause: " << pause_us << "us" << endl;
+    cout << setw(12) << "queue" << setw(10) << "producers" << setw(10) << "p50 us" << setw(10) << "p99 us"
+         << setw(12) << "max us" << setw(10) << "cpu %" << endl;
+    for(int producers = 1; producers <= max_producers; producers *= 2){
+        print("blocking", producers, run<blockingqueue::BlockingQueue<Stamp>>(producers, pushes, pause_us));
+        print("busy-poll", producers, run<BusyPollQueue>(producers, pushes, pause_us));
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/bash
+# Shared by the end-to-end benchmark scripts in bench/: starts the five servers of a local cluster from the
+# binaries in $BUILD, seeds accounts and times clients that run the workloads of workload.py.
+# BUILD (default build/ in the repo), BASE_PORT (default 9101) and CLIENT_CODEC (json or msgpack) can be set
+# from outside; SERVER_CPUS (a taskset cpu list, e.g. 0-3) pins the servers started after it is set.
+
+BENCH_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+BUILD=$(cd "${BUILD:-$BENCH_DIR/../build}" && pwd)
+BASE_PORT=${BASE_PORT:-9101}
+WORK_DIR=$(mktemp -d)
+CONFIG=$WORK_DIR/config.txt
+trap 'stop_cluster; rm -rf "$WORK_DIR"' EXIT
+
+port=$BASE_PORT
+for s in A B C D E; do echo "$s localhost $port"; port=$((port+1)); done > "$CONFIG"
+
+# start_cluster <server options> [lock timeout ms] [with detector: 1]
+start_cluster() {
+    for s in A B C D E; do
+        ${SERVER_CPUS:+taskset -c "$SERVER_CPUS"} "$BUILD/server" $s "$CONFIG" "$1" $2 > "$WORK_DIR/server_$s.log" 2>&1 &
+    done
+    sleep 0.5
+    if [ "$3" = 1 ]; then
+        "$BUILD/detector" "$CONFIG" 100 > "$WORK_DIR/detector.log" 2>&1 &
+    fi
+}
+
+stop_cluster() {
+    pkill -f "$BUILD/detector $CONFIG" 2>/dev/null
+    pkill -f "$BUILD/server . $CONFIG" 2>/dev/null
+    sleep 0.2
+}
+
+# seed_accounts <accounts per server>: a0..a<n-1> on every server, with a balance no transfer runs dry
+seed_accounts() {
+    python3 "$BENCH_DIR/workload.py" "$BUILD/client" "$CONFIG" seed seed "$1" 0 > /dev/null
+}
+
+# run_clients <clients> <timeout s> <workload> <workload arguments>
+# prints "txn/s committed aborted timed-out" of all clients together; a client still running at the timeout is
+# killed and counts as timed out, with none of its transactions
+run_clients() {
+    local clients=$1 limit=$2
+    shift 2
+    local start end pids=""
+    start=$(date +%s.%N)
+    for c in $(seq 1 "$clients"); do
+        timeout "$limit" python3 "$BENCH_DIR/workload.py" "$BUILD/client" "$CONFIG" "c$c" "$@" "$c" \
+            > "$WORK_DIR/client_$c.out" &
+        pids="$pids $!"
+    done
+    wait $pids
+    end=$(date +%s.%N)
+    cat "$WORK_DIR"/client_*.out | python3 -c "
+import sys
+counts = [line.split() for line in sys.stdin if line.strip()]
+committed = sum(int(c[0]) for c in counts)
+print('%.0f %d %d %d' % (committed / ($end - $start), committed, sum(int(c[1]) for c in counts),
+                         $clients - len(counts)))"
+    rm -f "$WORK_DIR"/client_*.out
+}
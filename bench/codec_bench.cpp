@@ -0,0 +1,57 @@
+// Wire codec cost per message: frame bytes and encode / decode ns per op of text JSON against MessagePack, for
+// the requests and replies a transfer sends, through the same encode_frame / decode_message the peers use.
+// usage: codec_bench [iterations]
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdlib>
+#include "../message_base.h"
+
+using namespace message_base;
+
+size_t sink = 0; // keeps the decoded messages from being optimized away
+
+int main(int argc, char const *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    vector<pair<string, json>> messages = {
+        {"DEPOSIT", json{{"clientID", "client-17"}, {"serverID", "A"}, {"type", DEPOSIT},
+                         {"account", "xyz"}, {"amount", 250}, {"ts", 1639012345678901ull}}},
+        {"BALANCE", json{{"clientID", "client-17"}, {"serverID", "A"}, {"type", BALANCE},
+                         {"account", "xyz"}, {"ts", 1639012345678901ull}}},
+        {"COMMIT", json{{"clientID", "client-17"}, {"CP_NUM", 1}, {"CP_STATE", true}, {"type", COMMIT}}},
+        {"reply", json{{"serverID", "A"}, {"state", true}, {"balance", 1000250}}},
+    };
+    cout << "iterations: " << iterations << endl;
+    cout << setw(10) << "message" << setw(10) << "codec" << setw(8) << "bytes" << setw(12) << "encode ns"
+         << setw(12) << "decode ns" << endl;
+    for(auto &message: messages){
+        for(WireCodec codec: {WireCodec::JSON_TEXT, WireCodec::MSGPACK}){
+            string frame;
+            auto start = chrono::steady_clock::now();
+            for(long i = 0; i < iterations; ++i){
+                encode_frame(frame, message.second, codec);
+                sink += frame.size();
+            }
+            double encode_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / iterations;
+            const char *payload = frame.data() + FRAME_HEADER_SIZE;
+            size_t len = frame.size() - FRAME_HEADER_SIZE;
+            start = chrono::steady_clock::now();
+            for(long i = 0; i < iterations; ++i){
+                json decoded = decode_message(payload, len, codec);
+                sink += decoded.size();
+            }
+            double decode_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / iterations;
+            if(decode_message(payload, len, codec) != message.second){
+                cout << "round trip changed the " << message.first << " message" << endl;
+                return 1;
+            }
+            cout << fixed << setprecision(0) << setw(10) << message.first
+                 << setw(10) << (codec == WireCodec::MSGPACK ? "msgpack" : "json") << setw(8) << frame.size()
+                 << setw(12) << encode_ns << setw(12) << decode_ns << endl;
+        }
+    }
+    return sink == 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Throughput of strict 2PL against optimistic concurrency control as contention grows: every transaction reads
+# one account and deposits into three, drawn from fewer and fewer accounts per server. Both run wound-wait.
+# usage: bench/contention_bench.sh [clients] [transactions per client]
+source "$(dirname "$0")/cluster.sh"
+CLIENTS=${1:-4}
+TXNS=${2:-200}
+
+echo "clients: $CLIENTS, transactions per client: $TXNS"
+printf "%-6s %9s %8s %10s %8s %10s\n" mode accounts txn/s committed aborted timed-out
+for accounts in 1000 100 10 2; do
+    for mode in 2pl occ; do
+        options=wound-wait
+        [ $mode = occ ] && options=occ,wound-wait
+        start_cluster $options
+        seed_accounts $accounts
+        printf "%-6s %9s %8s %10s %8s %10s\n" $mode $accounts $(run_clients "$CLIENTS" 300 contention "$TXNS" $accounts)
+        stop_cluster
+    done
+done
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Throughput of crossing transfers, the workload that deadlocks strict 2PL, under each way of breaking the
+# deadlocks: a lock wait timeout alone, the wait-for graph detector, wound-wait and wait-die.
+# usage: bench/deadlock_bench.sh [clients] [transactions per client]
+source "$(dirname "$0")/cluster.sh"
+CLIENTS=${1:-4}
+TXNS=${2:-200}
+
+echo "clients: $CLIENTS, transactions per client: $TXNS"
+printf "%-16s %8s %10s %8s %10s\n" handling txn/s committed aborted timed-out
+run() {
+    start_cluster "$2" "$3" "$4"
+    seed_accounts 1
+    printf "%-16s %8s %10s %8s %10s\n" "$1" $(run_clients "$CLIENTS" 300 crossing "$TXNS")
+    stop_cluster
+}
+run "timeout 1000ms" detect 1000
+run "detector" detect "" 1
+run "wound-wait" wound-wait
+run "wait-die" wait-die
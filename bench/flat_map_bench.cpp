@@ -0,0 +1,71 @@
+// Account lookup cost as the number of accounts grows: the std::map keyed by name the server used to have,
+// a FlatMap keyed by ids interned up front (what Transactions does with the ids from ClientSession), and
+// interning the name on every lookup before the FlatMap (what an RPC naming an account costs).
+// usage: flat_map_bench [lookups] [accounts...], accounts default to 10000 1000000 10000000
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include "../common/flat_map.hpp"
+#include "../common/string_interner.hpp"
+
+using namespace std;
+
+struct Account {
+    int amount = 0;
+};
+
+long sink = 0; // keeps the lookups from being optimized away
+
+template <typename Lookup>
+double ns_per_lookup(const vector<uint32_t> &queries, Lookup lookup) {
+    auto start = chrono::steady_clock::now();
+    for(uint32_t i: queries){
+        Account &account = lookup(i);
+        sink += ++account.amount;
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / queries.size();
+}
+
+int main(int argc, char const *argv[]) {
+    size_t lookups = argc > 1 ? strtoul(argv[1], nullptr, 10) : 5000000;
+    vector<size_t> sizes;
+    for(int i = 2; i < argc; ++i) sizes.push_back(strtoul(argv[i], nullptr, 10));
+    if(sizes.empty()) sizes = {10000, 1000000, 10000000};
+    cout << "lookups: " << lookups << endl;
+    cout << setw(10) << "accounts" << setw(16) << "map<string> ns" << setw(14) << "flat(id) ns"
+         << setw(20) << "intern+flat(id) ns" << endl;
+    for(size_t n: sizes){
+        vector<string> names(n);
+        for(size_t i = 0; i < n; ++i) names[i] = "acct" + to_string(i * 7919 % n);
+        mt19937 rng(2);
+        vector<uint32_t> queries(lookups);
+        for(auto &q: queries) q = rng() % n;
+
+        double tree_ns;
+        {
+            map<string, Account> tree;
+            for(auto &name: names) tree.emplace(name, Account());
+            tree_ns = ns_per_lookup(queries, [&](uint32_t i) -> Account & { return tree.at(names[i]); });
+        }
+        interning::StringInterner ids;
+        flatmap::FlatMap<unique_ptr<Account>> flat;
+        vector<uint32_t> keys(n);
+        for(size_t i = 0; i < n; ++i){
+            keys[i] = ids.intern(names[i]);
+            flat.emplace(keys[i], unique_ptr<Account>(new Account()));
+        }
+        double id_ns = ns_per_lookup(queries, [&](uint32_t i) -> Account & { return **flat.find(keys[i]); });
+        double intern_ns = ns_per_lookup(queries, [&](uint32_t i) -> Account & {
+            return **flat.find(ids.intern(names[i]));
+        });
+        cout << fixed << setprecision(1) << setw(10) << n << setw(16) << tree_ns << setw(14) << id_ns
+             << setw(20) << intern_ns << endl;
+    }
+    return sink == 0;
+}
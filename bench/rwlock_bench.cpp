@@ -0,0 +1,127 @@
+// Reader/writer lock throughput: threads take the lock for a short critical section, a given share of them
+// as readers. Compares the mutex-and-one-condition-variable lock rwlock.hpp used to have with the current
+// state-word lock, preferring readers and preferring writers, for 1 to max_threads threads.
+// usage: rwlock_bench [max_threads] [ops_per_thread]
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include "../common/rwlock.hpp"
+
+using namespace std;
+
+namespace legacy
+{
+    // rwlock::ReadWriteLock before the state-word rewrite, without the cancellation tokens
+    class ReadWriteLock {
+        private:
+            int readWaiting = 0;
+            int writeWaiting = 0;
+            int reading = 0;
+            int writing = 0;
+            mutable std::mutex mx;
+            mutable std::condition_variable cond;
+        public:
+            void readLock() {
+                std::unique_lock<std::mutex>lock(mx);
+                ++readWaiting;
+                cond.wait(lock,[&](){return writing <= 0;});
+                ++reading;
+                --readWaiting;
+            }
+
+            void writeLock() {
+                std::unique_lock<std::mutex>lock(mx);
+                ++writeWaiting;
+                cond.wait(lock, [&]() {return readWaiting <=0 && reading <= 0 && writing <= 0; });
+                ++writing;
+                --writeWaiting;
+            }
+
+            void readUnLock() {
+                std::unique_lock<std::mutex>lock(mx);
+                --reading;
+                if(reading<=0)
+                    cond.notify_one();
+            }
+
+            void writeUnLock() {
+                std::unique_lock<std::mutex>lock(mx);
+                --writing;
+                cond.notify_all();
+            }
+    };
+}
+
+atomic<long> sink{0}; // keeps the reads from being optimized away
+
+// Mops/s of threads each doing ops lock/unlock pairs, write_permille of them as writes; exits if a write was lost
+template <typename Lock>
+double run(Lock &rw, int threads, long ops, int write_permille) {
+    atomic<int> ready{0};
+    atomic<bool> go{false};
+    atomic<long> writes{0};
+    long shared = 0;
+    vector<thread> workers;
+    for(int t = 0; t < threads; ++t){
+        workers.emplace_back([&, t]() {
+            uint32_t rng = 2463534242u + t * 7919u;
+            long seen = 0, written = 0;
+            ++ready;
+            while(!go.load()) this_thread::yield();
+            for(long i = 0; i < ops; ++i){
+                rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+                if((int) (rng % 1000) < write_permille){
+                    rw.writeLock();
+                    ++shared;
+                    rw.writeUnLock();
+                    ++written;
+                }
+                else{
+                    rw.readLock();
+                    seen += shared;
+                    rw.readUnLock();
+                }
+            }
+            sink += seen;
+            writes += written;
+        });
+    }
+    while(ready.load() < threads) this_thread::yield();
+    auto start = chrono::steady_clock::now();
+    go.store(true);
+    for(auto &w: workers) w.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if(shared != writes.load()){
+        cout << "lost writes" << endl;
+        exit(1);
+    }
+    return threads * ops / seconds / 1e6;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    long ops = argc > 2 ? atol(argv[2]) : 200000;
+    cout << "cores: " << thread::hardware_concurrency() << ", ops per thread: " << ops << endl;
+    for(int write_permille: {0, 100, 500}){
+        cout << "writes: " << write_permille / 10 << "%" << endl;
+        cout << setw(8) << "threads" << setw(14) << "old Mops/s" << setw(16) << "new-rd Mops/s"
+             << setw(16) << "new-wr Mops/s" << endl;
+        for(int threads = 1; threads <= max_threads; threads *= 2){
+            legacy::ReadWriteLock old_lock;
+            rwlock::ReadWriteLock readers_first(rwlock::Preference::READERS);
+            rwlock::ReadWriteLock writers_first(rwlock::Preference::WRITERS);
+            double o = run(old_lock, threads, ops, write_permille);
+            double r = run(readers_first, threads, ops, write_permille);
+            double w = run(writers_first, threads, ops, write_permille);
+            cout << fixed << setprecision(2) << setw(8) << threads << setw(14) << o << setw(16) << r
+                 << setw(16) << w << endl;
+        }
+    }
+    return 0;
+}
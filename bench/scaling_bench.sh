@@ -0,0 +1,26 @@
+#!/bin/bash
+# Throughput as the servers get more cores: all five servers are pinned to the first 1, 2, 4 ... 32 cores and
+# two clients per core run transactions over accounts of their own, so nothing but the servers' shared
+# structures (lock table registry, interners, version store, queues) stands between them. Core counts above
+# the machine's are skipped; the clients are not pinned and need spare cores of their own to not skew it.
+# usage: bench/scaling_bench.sh [max cores] [transactions per client]
+source "$(dirname "$0")/cluster.sh"
+MAX_CORES=${1:-32}
+TXNS=${2:-200}
+
+echo "cores on this machine: $(nproc), transactions per client: $TXNS"
+printf "%-6s %6s %8s %8s %10s %8s %10s\n" mode cores clients txn/s committed aborted timed-out
+for cores in 1 2 4 8 16 32; do
+    if [ $cores -gt "$MAX_CORES" ] || [ $cores -gt "$(nproc)" ]; then
+        break
+    fi
+    for mode in 2pl occ; do
+        options=wound-wait
+        [ $mode = occ ] && options=occ,wound-wait
+        SERVER_CPUS=0-$((cores-1))
+        start_cluster $options
+        printf "%-6s %6s %8s %8s %10s %8s %10s\n" $mode $cores $((2*cores)) \
+            $(run_clients $((2*cores)) 600 disjoint "$TXNS")
+        stop_cluster
+    done
+done
@@ -0,0 +1,59 @@
+// Deposit storm on one hot account: every thread adds to the same balance. Compares the stripe mutex a plain
+// Balance takes, a single shared atomic and the per-core SplitCounter, for 1 to max_threads threads.
+// usage: split_counter_bench [max_threads] [adds_per_thread]
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <cstdlib>
+#include "../common/split_counter.hpp"
+
+using namespace std;
+
+// Mops/s of threads each calling add() adds times, all started together
+double run(int threads, long adds, const function<void()> &add) {
+    atomic<int> ready{0};
+    atomic<bool> go{false};
+    vector<thread> workers;
+    for(int t = 0; t < threads; ++t){
+        workers.emplace_back([&]() {
+            ++ready;
+            while(!go.load()) this_thread::yield();
+            for(long i = 0; i < adds; ++i) add();
+        });
+    }
+    while(ready.load() < threads) this_thread::yield();
+    auto start = chrono::steady_clock::now();
+    go.store(true);
+    for(auto &w: workers) w.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return threads * adds / seconds / 1e6;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) thread::hardware_concurrency() * 2;
+    long adds = argc > 2 ? atol(argv[2]) : 2000000;
+    cout << "cores: " << thread::hardware_concurrency() << ", adds per thread: " << adds << endl;
+    cout << setw(8) << "threads" << setw(14) << "mutex Mops/s" << setw(14) << "atomic Mops/s"
+         << setw(14) << "split Mops/s" << endl;
+    for(int threads = 1; threads <= max_threads; threads *= 2){
+        mutex mx;
+        long guarded = 0;
+        atomic<long> shared{0};
+        splitcounter::SplitCounter split;
+        double m = run(threads, adds, [&]() { lock_guard<mutex> lock(mx); ++guarded; });
+        double a = run(threads, adds, [&]() { shared.fetch_add(1, memory_order_relaxed); });
+        double s = run(threads, adds, [&]() { split.add(1); });
+        if(split.sum() != threads * adds || guarded != threads * adds){
+            cout << "lost updates" << endl;
+            return 1;
+        }
+        cout << fixed << setprecision(1) << setw(8) << threads << setw(14) << m << setw(14) << a << setw(14) << s << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+# Runs one client over a benchmark workload the way a user at the terminal would: every command is typed once
+# the answer to the previous one is printed, so a transaction the servers abort never swallows the commands
+# typed ahead of it. Prints "<committed> <aborted>" when the workload is done.
+# usage: workload.py <client binary> <config> <client id> seed <accounts> <client>
+#        workload.py <client binary> <config> <client id> crossing <transactions> <client>
+#        workload.py <client binary> <config> <client id> contention <transactions> <accounts> <client>
+#        workload.py <client binary> <config> <client id> aborting <transactions> <abort percent> <client>
+#        workload.py <client binary> <config> <client id> disjoint <transactions> <client>
+# CLIENT_CODEC (json or msgpack) is passed on to the client.
+import os
+import random
+import subprocess
+import sys
+
+SERVERS = "ABCDE"
+
+
+def seed(accounts, client):
+    for i in range(accounts):
+        yield [f"DEPOSIT {s}.a{i} 1000000" for s in SERVERS]
+
+
+def crossing(transactions, client):
+    # transfers between A.a0 and B.a0, odd clients lock A first and even ones B first, so without deadlock
+    # handling two clients end up waiting for each other
+    first, second = ("A.a0", "B.a0") if client % 2 else ("B.a0", "A.a0")
+    for _ in range(transactions):
+        yield [f"WITHDRAW {first} 1", f"DEPOSIT {second} 1"]
+
+
+def contention(transactions, accounts, client):
+    # a read and three deposits over the first <accounts> accounts of every server, fewer accounts mean more
+    # transactions touching the same ones
+    for _ in range(transactions):
+        yield ([f"BALANCE {random.choice(SERVERS)}.a{random.randrange(accounts)}"] +
+               [f"DEPOSIT {random.choice(SERVERS)}.a{random.randrange(accounts)} 1" for _ in range(3)])
+
+
+def aborting(transactions, abort_percent, client):
+    # eight deposits on one server, half of them into accounts the transaction creates, then the user aborts
+    # <abort percent> of the transactions
+    for _ in range(transactions):
+        deposits = [f"DEPOSIT A.{'a' if i % 2 else 'c%d_' % client}{random.randrange(100)} 1" for i in range(8)]
+        yield deposits + (["ABORT"] if random.randrange(100) < abort_percent else [])
+
+
+def disjoint(transactions, client):
+    # a read and three deposits over four accounts of its own on every server, no two clients ever conflict, so
+    # throughput is bound by the servers' shared structures only. The first transaction opens the accounts.
+    own = [f"{s}.c{client}_{i}" for s in SERVERS for i in range(4)]
+    yield [f"DEPOSIT {account} 1" for account in own]
+    for _ in range(transactions - 1):
+        yield [f"BALANCE {random.choice(own)}"] + [f"DEPOSIT {random.choice(own)} 1" for _ in range(3)]
+
+
+WORKLOADS = {"seed": seed, "crossing": crossing, "contention": contention, "aborting": aborting,
+             "disjoint": disjoint}
+
+
+# type one command and wait for its answer, false if it ended the transaction with an abort
+def run_command(client, command):
+    client.stdin.write(command + "\n")
+    client.stdin.flush()
+    while True:
+        answer = client.stdout.readline()
+        if not answer:
+            sys.exit("client exited")
+        answer = answer.strip()
+        if answer == "OK" or "ABORTED" in answer or " = " in answer:
+            return "ABORTED" not in answer
+
+
+def main():
+    binary, config, client_id, mode = sys.argv[1:5]
+    args = [int(a) for a in sys.argv[5:]]
+    random.seed(args[-1])
+    command = [binary, client_id, config] + ([os.environ["CLIENT_CODEC"]] if os.environ.get("CLIENT_CODEC") else [])
+    client = subprocess.Popen(command, stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                              text=True)
+    committed = aborted = 0
+    for transaction in WORKLOADS[mode](*args):
+        run_command(client, "BEGIN")
+        if all(run_command(client, c) for c in transaction) and run_command(client, "COMMIT"):
+            committed += 1
+        else:
+            aborted += 1
+    client.stdin.close()
+    client.wait()
+    print(committed, aborted)
+
+
+if __name__ == "__main__":
+    main()
@@ -10,8 +10,10 @@
 #include <unistd.h>
 #include <atomic>
 #include <map>
+#include <set>
 #include "message_base.h"
 #include "common/json.hpp"
+#include "common/blocking_queue.hpp"
 #define NUM_SERVERS 5
 using namespace std;
 using json = nlohmann::json;
@@ -55,91 +57,175 @@ namespace Client{
 
 }
 
-deque<json> cli_command_queue;
-mutex cli_command_queue_mtx;
+blockingqueue::BlockingQueue<json> cli_command_queue;
+blockingqueue::BlockingQueue<bool> cli_abort_done;
+mutex cli_abort_mtx;
+bool cli_aborting = false; // set from an ABORT until its replies are collected
+bool cli_txn_aborted = false; // a server aborted the transaction, the user's next commands belong to no transaction
+uint64_t cli_txn_ts = 0; // start of the current transaction, servers order conflicting transactions by it
+set<string> cli_txn_servers; // servers the current transaction has sent a request to
+bool cli_txn_writes = false; // false while the current transaction only issued BALANCE
 string client_id;
 message_base::MessageBaseClient client;
 vector<message_base::ServerInfo> sinfo;
 
+// an RPC popped before an ABORT but not sent yet must not reach its server behind the ABORT
+bool cast_unless_aborted(const json& rpc){
+    lock_guard<mutex> lock(cli_abort_mtx);
+    if(cli_aborting){
+        return false;
+    }
+    if(rpc.contains("serverID")){
+        return client.unicast(rpc["serverID"],rpc);
+    }
+    return client.multicast(rpc);
+}
+
+void collect_abort_replies(){
+    // wait for 5 servers to abort, each answers the RPC that may have been in flight first
+    int num_replies = 0;
+    while(num_replies<NUM_SERVERS){
+        json rpl = client.client_recv(sinfo[num_replies].server_identifier);
+        if (rpl.contains("state") && rpl["state"].get<bool>()) {
+            DEBUG_INFO("RECEIVE FROM "+sinfo[num_replies].server_identifier);
+        }
+        num_replies++;
+    }
+    lock_guard<mutex> lock(cli_abort_mtx);
+    cli_aborting = false;
+}
+
+// a server gave up on the transaction (deadlock victim), abort it everywhere as if the user had typed ABORT
+void abort_by_server(){
+    {
+        lock_guard<mutex> lock(cli_abort_mtx);
+        if(cli_aborting){
+            return; // the user's ABORT is already on its way
+        }
+        cli_aborting = true;
+        cli_txn_aborted = true;
+        cli_command_queue.clear();
+        client.multicast(json{{"clientID", client_id},
+                              {"type", message_base::ABORT}});
+    }
+    collect_abort_replies();
+    Client::reply_abort();
+}
+
+bool transaction_aborted_by_server(){
+    lock_guard<mutex> lock(cli_abort_mtx);
+    bool aborted = cli_txn_aborted;
+    cli_txn_aborted = false;
+    return aborted;
+}
 
 void cli_rpc_worker(){
-    while(true)
+    json rpc;
+    // an ABORT is queued after it has been multicast, only to collect the replies in order
+    while(cli_command_queue.pop(rpc)) // sleeps until the user types a command
     {
-        sleep(0.001);
-        // other RPCs, abort will never be in the queue
-        cli_command_queue_mtx.lock();
-        if(!cli_command_queue.empty()){
-            json rpc = cli_command_queue.front();
-            cli_command_queue_mtx.unlock();
 
-            DEBUG_INFO(rpc.dump()+" In thread");
-            if(rpc["type"].get<string>()==message_base::DEPOSIT){
-                // send RPC to server
-                if(client.unicast(rpc["serverID"],rpc)){
-                    // wait for reply
-                    json rpl = client.client_recv(rpc["serverID"]);
-                    if(rpl.contains("state") && rpl["state"].get<bool>()) {
-                        Client::reply_ok();
-                    }
+        DEBUG_INFO(rpc.dump()+" In thread");
+        if(rpc["type"].get<string>()==message_base::DEPOSIT){
+            // send RPC to server
+            if(cast_unless_aborted(rpc)){
+                // wait for reply
+                json rpl = client.client_recv(rpc["serverID"]);
+                if(rpl.contains("aborted")){
+                    abort_by_server(); // unless the user aborted meanwhile
+                    continue;
+                }
+                if(rpl.contains("state") && rpl["state"].get<bool>()) {
+                    Client::reply_ok();
                 }
             }
-            else if(rpc["type"].get<string>()==message_base::BALANCE){
-                // send RPC to server
-                if(client.unicast(rpc["serverID"],rpc)){
-                    // wait for reply of balance
-                    json rpl = client.client_recv(rpc["serverID"]);
-                    if(rpl.contains("balance") && rpl.contains("state") && rpl["state"].get<bool>()){
-                        cout << rpc["serverID"].get<string>() + "." + rpc["account"].get<string>() << " = " << rpl["balance"] << endl;
-                    }
-                    else{
-                        Client::reply_reject();
-                    }
+        }
+        else if(rpc["type"].get<string>()==message_base::BALANCE){
+            // send RPC to server
+            if(cast_unless_aborted(rpc)){
+                // wait for reply of balance
+                json rpl = client.client_recv(rpc["serverID"]);
+                if(rpl.contains("aborted")){
+                    abort_by_server();
+                    continue;
+                }
+                if(rpl.contains("balance") && rpl.contains("state") && rpl["state"].get<bool>()){
+                    cout << rpc["serverID"].get<string>() + "." + rpc["account"].get<string>() << " = " << rpl["balance"] << endl;
+                }
+                else{
+                    Client::reply_reject();
                 }
             }
-            else if(rpc["type"]==message_base::WITHDRAW){
-                // send RPC to server
-                if(client.unicast(rpc["serverID"],rpc)){
-                    // wait for reply of withdraw state
-                    json rpl = client.client_recv(rpc["serverID"].get<string>());
-                    if(rpl.contains("state") && rpl["state"].get<bool>()){
-                        Client::reply_ok();
-                    }else{
-                        Client::reply_reject();
-                    }
+        }
+        else if(rpc["type"]==message_base::WITHDRAW){
+            // send RPC to server
+            if(cast_unless_aborted(rpc)){
+                // wait for reply of withdraw state
+                json rpl = client.client_recv(rpc["serverID"].get<string>());
+                if(rpl.contains("aborted")){
+                    abort_by_server();
+                    continue;
+                }
+                if(rpl.contains("state") && rpl["state"].get<bool>()){
+                    Client::reply_ok();
+                }else{
+                    Client::reply_reject();
                 }
             }
-            else if (rpc["type"].get<string>()==message_base::COMMIT){
-                // send RPC to server
-                if(client.multicast(rpc)) {
-                    // wait for 5 servers to commit/abort
-                    int num_replies = 0;
-                    bool can_commit = true;
-                    while(num_replies<NUM_SERVERS){
-                        json rpl = client.client_recv(sinfo[num_replies].server_identifier);
-                        if (rpl.contains("state") && !rpl["state"].get<bool>()) {
-                            can_commit = false; // is any of them is false (abort)
-                        }
-                        num_replies++;
+        }
+        else if (rpc["type"].get<string>()==message_base::COMMIT && rpc.contains("read_only")){
+            // single round: the servers read from commit or abort on their own
+            bool can_commit = true;
+            for(auto& participant: rpc["participants"]){
+                json cp1 = rpc;
+                cp1.erase("participants");
+                cp1["serverID"] = participant;
+                client.unicast(participant.get<string>(), cp1);
+            }
+            for(auto& participant: rpc["participants"]){
+                json rpl = client.client_recv(participant.get<string>());
+                if (!rpl.contains("state") || !rpl["state"].get<bool>()) {
+                    can_commit = false;
+                }
+            }
+            if(can_commit){
+                Client::reply_ok();
+            }else{
+                Client::reply_abort();
+            }
+        }
+        else if (rpc["type"].get<string>()==message_base::COMMIT){
+            // send RPC to server
+            if(cast_unless_aborted(rpc)) {
+                // wait for 5 servers to commit/abort
+                int num_replies = 0;
+                bool can_commit = true;
+                vector<string> second_round; // a server that found nothing written here has finished already
+                while(num_replies<NUM_SERVERS){
+                    json rpl = client.client_recv(sinfo[num_replies].server_identifier);
+                    if (rpl.contains("state") && !rpl["state"].get<bool>()) {
+                        can_commit = false; // is any of them is false (abort)
                     }
-                    if(can_commit){
-                        rpc["CP_NUM"] = 2;
-                        rpc["CP_STATE"] = true;
-                        client.multicast(rpc);
-                        Client::reply_ok();
-                    }else{
-                        rpc["CP_NUM"] = 2;
-                        rpc["CP_STATE"] = false;
-                        client.multicast(rpc);
-                        Client::reply_abort();
+                    if(!rpl.value("read_only", false)){
+                        second_round.push_back(sinfo[num_replies].server_identifier);
                     }
+                    num_replies++;
+                }
+                rpc["CP_NUM"] = 2;
+                rpc["CP_STATE"] = can_commit;
+                for(auto& server_identifier: second_round){
+                    client.unicast(server_identifier, rpc);
+                }
+                if(can_commit){
+                    Client::reply_ok();
+                }else{
+                    Client::reply_abort();
                 }
             }
-            cli_command_queue_mtx.lock();
-            cli_command_queue.pop_front();
-            cli_command_queue_mtx.unlock();
         }
-        else{
-            cli_command_queue_mtx.unlock();
+        else if (rpc["type"].get<string>()==message_base::ABORT){
+            collect_abort_replies();
+            cli_abort_done.push(true);
         }
     }
 }
@@ -147,9 +233,15 @@ void cli_rpc_worker(){
 // client
 int main(int argc, char const *argv[]) {
     string config_file;
-    if(argc==3){
+    message_base::WireCodec codec = message_base::WireCodec::JSON_TEXT;
+    if(argc==3 || argc==4){
         client_id = argv[1];
         config_file = argv[2];
+        // optional wire codec: json (default) or msgpack
+        if(argc==4 && !message_base::parse_wire_codec(argv[3], codec)){
+            cout << "unknown wire codec " << argv[3] << endl;
+            return 0;
+        }
 
         ifstream configfilestream(config_file);
         string node_identifier, node_address;
@@ -173,26 +265,35 @@ int main(int argc, char const *argv[]) {
     }
 
     // automatically connect to all the necessary servers
-    client = message_base::MessageBaseClient(sinfo);
+    client = message_base::MessageBaseClient(sinfo, codec);
 
     thread cli_rpc_thread(cli_rpc_worker);
-    auto cli_rpc_thread_handle = cli_rpc_thread.native_handle();
-    cli_rpc_thread.detach();
     //int phase;
 
     DEBUG_INFO("start accepting commands typed in by the user");
     // start accepting commands typed in by the user
     string command;
-    while(getline(cin, command))
+    bool replay_command = false;
+    while(replay_command || getline(cin, command))
     {
+        replay_command = false;
         // You should ignore any commands occuring outside a transaction (other than BEGIN).
         if(command == message_base::BEGIN)
         {
             // BEGIN: Open a new transaction, and reply with “OK”.
+            transaction_aborted_by_server(); // a server abort of the previous transaction was already reported
+            cli_txn_ts = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+            cli_txn_servers.clear();
+            cli_txn_writes = false;
             Client::reply_ok();
             while(getline(cin, command))
             {
                 DEBUG_INFO("Get from CLI: "+command);
+                if(transaction_aborted_by_server()){
+                    // the worker already printed ABORTED, this command is outside any transaction
+                    replay_command = true;
+                    break;
+                }
                 auto str_list = parse(command);
                 // DEPOSIT server.account amount: Deposit some amount into an account. Amount will be a positive integer. (You can assume that the value of any account will never exceed 1,000,000,000.) The account balance should increase by the given amount. If the account was previously unreferenced, it should be created with an initial balance of amount. The client should reply with OK
                 // BALANCE server.account: The client should display the current balance in the given account. If a query is made to an account that has not previously received a deposit, the client should print NOT FOUND, ABORTED and abort the transaction.
@@ -209,7 +310,8 @@ int main(int argc, char const *argv[]) {
                                    {"serverID", server_account_pair.first},
                                    {"type", message_base::DEPOSIT},
                                    {"account", server_account_pair.second},
-                                   {"amount", amount},};
+                                   {"amount", amount},
+                                   {"ts", cli_txn_ts},};
                     }
                     else if(str_list[0]==message_base::BALANCE){
                         auto server_account_str = parse(str_list[1],'.');
@@ -218,7 +320,8 @@ int main(int argc, char const *argv[]) {
                         rpc = json{{"clientID", client_id},
                                    {"serverID", server_account_pair.first},
                                    {"type", message_base::BALANCE},
-                                   {"account", server_account_pair.second},};
+                                   {"account", server_account_pair.second},
+                                   {"ts", cli_txn_ts},};
 
                     }
                     else if(str_list[0]==message_base::WITHDRAW){
@@ -229,7 +332,8 @@ int main(int argc, char const *argv[]) {
                                    {"serverID", server_account_pair.first},
                                    {"type", message_base::WITHDRAW},
                                    {"account", server_account_pair.second},
-                                   {"amount", amount},};
+                                   {"amount", amount},
+                                   {"ts", cli_txn_ts},};
 
                     }
                     else if (str_list[0]==message_base::COMMIT){
@@ -237,6 +341,11 @@ int main(int argc, char const *argv[]) {
                                    {"CP_NUM", 1},
                                    {"CP_STATE", true}, // true means can commit
                                    {"type", message_base::COMMIT}};
+                        if(!cli_txn_writes){
+                            // read-only: one round to the servers it read from, each validates and releases at once
+                            rpc["read_only"] = true;
+                            rpc["participants"] = cli_txn_servers;
+                        }
 
                     }
                     else if (str_list[0]==message_base::ABORT){
@@ -244,38 +353,36 @@ int main(int argc, char const *argv[]) {
 
                         rpc = json{{"clientID", client_id},
                                    {"type", message_base::ABORT}};
-                        // now ABORT is at the front
-                        cli_command_queue_mtx.lock();
-                        cli_command_queue.clear();
-                        cli_command_queue_mtx.unlock();
-
-                        pthread_cancel(cli_rpc_thread_handle); // stop waiting the response of the server because it already responsed or never response
-                        cli_command_queue_mtx.unlock(); // unlock the mutex anyway
-                        DEBUG_INFO("ABORT AND MULTICAST");
-                        // send RPC to server
-                        if (client.multicast(rpc)) {
-                            int num_replies = 0;
-                            // wait for 5 servers to abort
-                            while(num_replies<NUM_SERVERS){
-                                json rpl = client.client_recv(sinfo[num_replies].server_identifier);
-                                if (rpl.contains("state") && rpl["state"].get<bool>()) {
-                                    DEBUG_INFO("RECEIVE FROM "+sinfo[num_replies].server_identifier);
-                                }
-                                num_replies++;
+                        bool aborted_by_server;
+                        {
+                            lock_guard<mutex> lock(cli_abort_mtx);
+                            aborted_by_server = cli_aborting || cli_txn_aborted; // the worker reports that abort
+                            cli_txn_aborted = false;
+                            if(!aborted_by_server){
+                                cli_aborting = true;
+                                cli_command_queue.clear();
+                                DEBUG_INFO("ABORT AND MULTICAST");
+                                // send RPC to server, a server waiting on a lock for this transaction gives up at once
+                                client.multicast(rpc);
                             }
                         }
-
-                        cli_rpc_thread = thread(cli_rpc_worker);
-                        cli_rpc_thread_handle = cli_rpc_thread.native_handle();
-                        cli_rpc_thread.detach();
+                        if(aborted_by_server){
+                            break;
+                        }
+                        // the worker collects the replies once the RPC it may be waiting on is answered
+                        cli_command_queue.push(rpc);
+                        bool aborted;
+                        cli_abort_done.pop(aborted);
                         Client::reply_abort();
                         break;
                     }
+                    if(rpc.contains("serverID")){
+                        cli_txn_servers.insert(rpc["serverID"].get<string>());
+                        cli_txn_writes = cli_txn_writes || str_list[0]!=message_base::BALANCE;
+                    }
                     // push the cli command json rpc to the queue
                     if(str_list[0]!=message_base::ABORT){
-                        cli_command_queue_mtx.lock();
-                        cli_command_queue.push_back(rpc);
-                        cli_command_queue_mtx.unlock();
+                        cli_command_queue.push(rpc);
                     }
 
                     if(str_list[0]==message_base::COMMIT||str_list[0]==message_base::ABORT){
@@ -286,4 +393,7 @@ int main(int argc, char const *argv[]) {
         }
     }
 
+    // end of input: let the worker finish the commands already queued
+    cli_command_queue.close();
+    cli_rpc_thread.join();
 }
@@ -0,0 +1,128 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_ARENA_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_ARENA_HPP
+// file: arena.hpp
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace arena
+{
+    // Bump allocator for memory that dies all at once, like everything a transaction builds up: allocating is a
+    // pointer increment, nothing is freed on its own and reset() rewinds the whole arena. After a reset that
+    // needed several chunks the arena keeps one chunk big enough for all of them, so a steady workload stops
+    // hitting the heap, up to max_retained bytes.
+    class Arena {
+        private:
+            std::vector<std::unique_ptr<char[]>> chunks;
+            std::vector<std::size_t> chunk_sizes;
+            std::size_t first_chunk_size;
+            std::size_t max_retained;
+            std::size_t used = 0; // in the last chunk
+
+            void add_chunk(std::size_t size) {
+                chunks.emplace_back(new char[size]);
+                chunk_sizes.push_back(size);
+                used = 0;
+            }
+
+        public:
+            explicit Arena(std::size_t first_chunk_size_ = 4096, std::size_t max_retained_ = 1 << 20)
+                : first_chunk_size(first_chunk_size_), max_retained(max_retained_) {}
+            Arena(const Arena &) = delete;
+            Arena & operator=(const Arena &) = delete;
+
+            void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t)) {
+                if(!chunks.empty()){
+                    uintptr_t base = reinterpret_cast<uintptr_t>(chunks.back().get());
+                    std::size_t offset = ((base + used + align - 1) & ~(uintptr_t) (align - 1)) - base;
+                    if(offset + size <= chunk_sizes.back()){
+                        used = offset + size;
+                        return chunks.back().get() + offset;
+                    }
+                }
+                std::size_t size_needed = size + align;
+                std::size_t next = chunks.empty() ? first_chunk_size : chunk_sizes.back() * 2;
+                add_chunk(next < size_needed ? size_needed : next);
+                return allocate(size, align);
+            }
+
+            // p was handed out by this arena
+            bool owns(const void *p) const {
+                for(std::size_t i = 0; i < chunks.size(); ++i){
+                    const char *chunk = chunks[i].get();
+                    if(p >= chunk && p < chunk + chunk_sizes[i])
+                        return true;
+                }
+                return false;
+            }
+
+            // everything allocated so far is gone
+            void reset() {
+                if(chunks.size() > 1){
+                    std::size_t total = 0;
+                    for(std::size_t size: chunk_sizes)
+                        total += size;
+                    chunks.clear();
+                    chunk_sizes.clear();
+                    add_chunk(total > max_retained ? first_chunk_size : total);
+                }
+                used = 0;
+            }
+    };
+
+    // the arena ArenaAllocator takes memory from on the calling thread, nullptr for the heap
+    inline Arena *& current_arena() {
+        static thread_local Arena *arena = nullptr;
+        return arena;
+    }
+
+    // makes an arena the calling thread's current one until the end of the scope
+    class ArenaScope {
+        private:
+            Arena *previous;
+        public:
+            explicit ArenaScope(Arena &arena) : previous(current_arena()) { current_arena() = &arena; }
+            ~ArenaScope() { current_arena() = previous; }
+            ArenaScope(const ArenaScope &) = delete;
+            ArenaScope & operator=(const ArenaScope &) = delete;
+    };
+
+    // Standard allocator over the thread's current arena, for containers that allocate through a default
+    // constructed allocator like nlohmann::basic_json does. Freeing memory of the current arena does nothing;
+    // without one it falls back to the heap. Whatever it allocated must be gone before its arena is reset.
+    template <typename T>
+    class ArenaAllocator {
+        public:
+            typedef T value_type;
+
+            ArenaAllocator() = default;
+            template <typename U>
+            ArenaAllocator(const ArenaAllocator<U> &) {}
+
+            T* allocate(std::size_t n) {
+                Arena *arena = current_arena();
+                if(arena == nullptr)
+                    return static_cast<T*>(::operator new(n * sizeof(T)));
+                return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+            }
+
+            void deallocate(T *p, std::size_t) {
+                Arena *arena = current_arena();
+                if(arena == nullptr || !arena->owns(p))
+                    ::operator delete(p);
+            }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return true; }
+
+    template <typename T, typename U>
+    bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return false; }
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_ARENA_HPP
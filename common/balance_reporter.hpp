@@ -0,0 +1,134 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_BALANCE_REPORTER_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_BALANCE_REPORTER_HPP
+// file: balance_reporter.hpp
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include "blocking_queue.hpp"
+
+namespace balancereport
+{
+    typedef uint32_t Key; // interned account id
+    typedef std::vector<std::pair<Key, int>> Deltas; // net change of each account written by one commit
+
+    /*
+     * Prints the committed balances off the commit path. A commit only queues its deltas; a background thread
+     * adds them up and writes every positive balance in name order. Deltas queued while it was writing are
+     * coalesced into one report, and a minimum interval between reports bounds the output rate. Deltas
+     * commute, so commits that publish out of order still add up to the committed state.
+     */
+    class BalanceReporter {
+        private:
+            blockingqueue::BlockingQueue<Deltas> feed;
+            std::map<std::string, int> balances; // owned by the reporter thread
+            std::map<Key, std::map<std::string, int>::iterator> by_key;
+            std::function<std::string(Key)> name_of;
+            std::chrono::milliseconds interval{0};
+            std::ofstream binary; // reports go here instead of stdout when open
+            std::thread worker;
+
+            void apply(const Deltas &deltas) {
+                for(auto &delta: deltas){
+                    auto it = by_key.find(delta.first);
+                    if(it == by_key.end())
+                        it = by_key.emplace(delta.first, balances.emplace(name_of(delta.first), 0).first).first;
+                    it->second->second += delta.second;
+                }
+            }
+
+            static void put_u32(std::string &out, uint32_t v) {
+                for(int shift = 24; shift >= 0; shift -= 8)
+                    out.push_back(static_cast<char>((v >> shift) & 0xff));
+            }
+
+            // text: "name = balance" lines; binary: u32 count, then per account u32 name length, name, i32 balance,
+            // big-endian like the message frames
+            void report() {
+                std::string out;
+                if(binary.is_open()){
+                    std::string records;
+                    uint32_t count = 0;
+                    for(auto &balance: balances){
+                        if(balance.second <= 0)
+                            continue;
+                        put_u32(records, static_cast<uint32_t>(balance.first.size()));
+                        records += balance.first;
+                        put_u32(records, static_cast<uint32_t>(balance.second));
+                        ++count;
+                    }
+                    put_u32(out, count);
+                    out += records;
+                    binary.write(out.data(), out.size());
+                    binary.flush();
+                    return;
+                }
+                for(auto &balance: balances){
+                    if(balance.second > 0)
+                        out += balance.first + " = " + std::to_string(balance.second) + "\n";
+                }
+                std::cout << out << std::flush; // one write per report instead of a flush per line
+            }
+
+            void run() {
+                Deltas deltas;
+                while(feed.pop(deltas)){
+                    apply(deltas);
+                    while(feed.try_pop(deltas))
+                        apply(deltas);
+                    report();
+                    if(interval.count() > 0)
+                        std::this_thread::sleep_for(interval); // commits meanwhile end up in the next report
+                }
+            }
+
+        public:
+            BalanceReporter() = default;
+            BalanceReporter(const BalanceReporter &) = delete;
+            BalanceReporter & operator=(const BalanceReporter &) = delete;
+
+            ~BalanceReporter() {
+                stop();
+            }
+
+            // at most one report per interval_, 0 reports as soon as the reporter is free
+            void set_interval(std::chrono::milliseconds interval_) {
+                interval = interval_;
+            }
+
+            // write binary reports to path instead of text to stdout; false if it cannot be opened
+            bool set_binary(const std::string &path) {
+                binary.open(path, std::ios::binary | std::ios::trunc);
+                return binary.is_open();
+            }
+
+            void start(std::function<std::string(Key)> name_of_) {
+                name_of = std::move(name_of_);
+                worker = std::thread(&BalanceReporter::run, this);
+            }
+
+            // queue the deltas of one commit, never blocks on the output
+            void publish(Deltas deltas) {
+                if(!deltas.empty())
+                    feed.push(std::move(deltas));
+            }
+
+            // report what is queued and end the reporter thread
+            void stop() {
+                feed.close();
+                if(worker.joinable())
+                    worker.join();
+            }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_BALANCE_REPORTER_HPP
@@ -0,0 +1,77 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_BLOCKING_QUEUE_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_BLOCKING_QUEUE_HPP
+// file: blocking_queue.hpp
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+namespace blockingqueue
+{
+    // Multi-producer queue whose consumer sleeps on a condition variable while the queue is empty,
+    // so an idle connection costs no CPU and a push wakes the consumer right away.
+    template <typename T>
+    class BlockingQueue {
+        private:
+            std::deque<T> items;
+            mutable std::mutex mx;
+            std::condition_variable not_empty;
+            bool closed = false;
+        public:
+            BlockingQueue() = default;
+            BlockingQueue(const BlockingQueue &) = delete;
+            BlockingQueue & operator=(const BlockingQueue &) = delete;
+
+            void push(T item) {
+                {
+                    std::lock_guard<std::mutex> lock(mx);
+                    items.push_back(std::move(item));
+                }
+                not_empty.notify_one(); // outside the lock so the woken consumer does not block on mx again
+            }
+
+            // block until an item is available, false once the queue is closed and drained
+            bool pop(T &item) {
+                std::unique_lock<std::mutex> lock(mx);
+                not_empty.wait(lock, [&]() {return !items.empty() || closed; });
+                if(items.empty())
+                    return false;
+                item = std::move(items.front());
+                items.pop_front();
+                return true;
+            }
+
+            bool try_pop(T &item) {
+                std::lock_guard<std::mutex> lock(mx);
+                if(items.empty())
+                    return false;
+                item = std::move(items.front());
+                items.pop_front();
+                return true;
+            }
+
+            // wake the consumer for good, items already queued are still handed out
+            void close() {
+                {
+                    std::lock_guard<std::mutex> lock(mx);
+                    closed = true;
+                }
+                not_empty.notify_all();
+            }
+
+            void clear() {
+                std::lock_guard<std::mutex> lock(mx);
+                items.clear();
+            }
+
+            std::size_t size() const {
+                std::lock_guard<std::mutex> lock(mx);
+                return items.size();
+            }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_BLOCKING_QUEUE_HPP
@@ -0,0 +1,58 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_BUFFER_POOL_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_BUFFER_POOL_HPP
+// file: buffer_pool.hpp
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstddef>
+
+namespace bufferpool
+{
+    // Free list of byte buffers reused across messages and connections, so a connection only owns memory
+    // while it has bytes in flight and the heap is not hit for every message.
+    class BufferPool {
+        private:
+            std::vector<std::string> free_buffers;
+            std::size_t max_pooled;          // buffers kept on the free list
+            std::size_t max_pooled_capacity; // larger buffers are freed instead of pooled
+            std::mutex mx;
+        public:
+            BufferPool(std::size_t max_pooled_ = 256, std::size_t max_pooled_capacity_ = 64*1024)
+                : max_pooled(max_pooled_), max_pooled_capacity(max_pooled_capacity_) {}
+
+            BufferPool(const BufferPool &) = delete;
+            BufferPool & operator=(const BufferPool &) = delete;
+
+            // an empty buffer, its capacity is whatever a previous user grew it to
+            std::string acquire() {
+                std::lock_guard<std::mutex> lock(mx);
+                if(free_buffers.empty())
+                    return std::string();
+                std::string buf = std::move(free_buffers.back());
+                free_buffers.pop_back();
+                return buf;
+            }
+
+            void release(std::string &&buf) {
+                if(buf.capacity()>max_pooled_capacity){
+                    std::string().swap(buf); // oversized by one big message, give it back to the heap
+                    return;
+                }
+                buf.clear();
+                std::lock_guard<std::mutex> lock(mx);
+                if(free_buffers.size()<max_pooled)
+                    free_buffers.push_back(std::move(buf));
+            }
+    };
+
+    // process wide pool shared by all connections
+    inline BufferPool & default_pool() {
+        static BufferPool pool;
+        return pool;
+    }
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_BUFFER_POOL_HPP
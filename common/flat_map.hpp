@@ -0,0 +1,227 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_FLAT_MAP_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_FLAT_MAP_HPP
+// file: flat_map.hpp
+#pragma once
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "arena.hpp"
+
+namespace flatmap
+{
+    typedef uint32_t Key; // interned id, 0 is never handed out and marks an empty slot
+
+    /*
+     * Open-addressing hash table over interned ids with linear probing. The keys sit in one flat array, so a
+     * lookup is a multiply and a short scan of adjacent slots instead of string compares down a tree, and
+     * nothing is allocated per entry. Erasing shifts the following run back, so there are no tombstones.
+     * Inserting may move every value: hold one by pointer only while nothing is inserted, or store a pointer.
+     * The arrays come from the heap, or from an arena that outlives the map; grown-out-of arrays stay in the
+     * arena until it is reset.
+     */
+    template <typename V>
+    class FlatMap {
+        private:
+            typedef typename std::aligned_storage<sizeof(V), alignof(V)>::type Storage;
+            arena::Arena *arena = nullptr;
+            Key *keys = nullptr;
+            Storage *values = nullptr;
+            std::size_t capacity = 0; // 0 or a power of two
+            std::size_t count = 0;
+            unsigned shift = 32;
+
+            V & value_at(std::size_t i) {
+                return *reinterpret_cast<V*>(&values[i]);
+            }
+
+            std::size_t home(Key key) const {
+                return (std::size_t) ((key * 2654435769u) >> shift); // Fibonacci hashing spreads dense ids
+            }
+
+            std::size_t slot_of(Key key) const {
+                if(capacity == 0)
+                    return capacity;
+                for(std::size_t i = home(key);; i = (i + 1) & (capacity - 1)){
+                    if(keys[i] == key)
+                        return i;
+                    if(keys[i] == 0)
+                        return capacity;
+                }
+            }
+
+            void destroy() {
+                for(std::size_t i = 0; i < capacity; ++i)
+                    if(keys[i] != 0)
+                        value_at(i).~V();
+            }
+
+            void free_arrays(Key *old_keys, Storage *old_values) {
+                if(arena != nullptr)
+                    return;
+                delete[] old_keys;
+                delete[] old_values;
+            }
+
+            void rehash(std::size_t new_capacity) {
+                Key *old_keys = keys;
+                Storage *old_values = values;
+                std::size_t old_capacity = capacity;
+                if(arena != nullptr){
+                    keys = static_cast<Key*>(arena->allocate(new_capacity * sizeof(Key), alignof(Key)));
+                    values = static_cast<Storage*>(arena->allocate(new_capacity * sizeof(Storage), alignof(Storage)));
+                }
+                else{
+                    keys = new Key[new_capacity];
+                    values = new Storage[new_capacity];
+                }
+                std::memset(keys, 0, new_capacity * sizeof(Key));
+                capacity = new_capacity;
+                shift = 32;
+                for(std::size_t c = new_capacity; c > 1; c >>= 1)
+                    --shift;
+                for(std::size_t i = 0; i < old_capacity; ++i){
+                    if(old_keys[i] == 0)
+                        continue;
+                    V &old = *reinterpret_cast<V*>(&old_values[i]);
+                    std::size_t j = home(old_keys[i]);
+                    while(keys[j] != 0)
+                        j = (j + 1) & (capacity - 1);
+                    keys[j] = old_keys[i];
+                    new (&values[j]) V(std::move(old));
+                    old.~V();
+                }
+                free_arrays(old_keys, old_values);
+            }
+
+        public:
+            struct Entry {
+                Key key;
+                V &value;
+            };
+
+            class iterator {
+                private:
+                    FlatMap *map;
+                    std::size_t i;
+                    void skip() {
+                        while(i < map->capacity && map->keys[i] == 0)
+                            ++i;
+                    }
+                public:
+                    iterator(FlatMap *map_, std::size_t i_) : map(map_), i(i_) { skip(); }
+                    Entry operator*() const { return Entry{map->keys[i], map->value_at(i)}; }
+                    iterator & operator++() { ++i; skip(); return *this; }
+                    bool operator!=(const iterator &other) const { return i != other.i; }
+            };
+
+            FlatMap() = default;
+            explicit FlatMap(arena::Arena *arena_) : arena(arena_) {}
+            FlatMap(const FlatMap &) = delete;
+            FlatMap & operator=(const FlatMap &) = delete;
+
+            FlatMap(FlatMap &&other) : arena(other.arena), keys(other.keys), values(other.values),
+                                       capacity(other.capacity), count(other.count), shift(other.shift) {
+                other.keys = nullptr;
+                other.values = nullptr;
+                other.capacity = 0;
+                other.count = 0;
+                other.shift = 32;
+            }
+
+            ~FlatMap() {
+                destroy();
+                free_arrays(keys, values);
+            }
+
+            // room for n entries without rehashing
+            void reserve(std::size_t n) {
+                std::size_t needed = 8;
+                while(needed * 3 < n * 4)
+                    needed <<= 1;
+                if(needed > capacity)
+                    rehash(needed);
+            }
+
+            V * find(Key key) {
+                std::size_t i = slot_of(key);
+                return i == capacity ? nullptr : &value_at(i);
+            }
+
+            bool contains(Key key) const {
+                return slot_of(key) != capacity;
+            }
+
+            // the value of key, constructed from args if it is new; second is false if it already existed
+            template <typename... Args>
+            std::pair<V*, bool> emplace(Key key, Args&&... args) {
+                std::size_t i = slot_of(key);
+                if(i != capacity)
+                    return std::make_pair(&value_at(i), false);
+                if((count + 1) * 4 > capacity * 3)
+                    rehash(capacity == 0 ? 8 : capacity * 2);
+                i = home(key);
+                while(keys[i] != 0)
+                    i = (i + 1) & (capacity - 1);
+                new (&values[i]) V(std::forward<Args>(args)...);
+                keys[i] = key;
+                ++count;
+                return std::make_pair(&value_at(i), true);
+            }
+
+            // the value of key, value-initialized if it is new
+            V & operator[](Key key) {
+                return *emplace(key).first;
+            }
+
+            bool erase(Key key) {
+                std::size_t i = slot_of(key);
+                if(i == capacity)
+                    return false;
+                value_at(i).~V();
+                --count;
+                // pull back every entry of the run that would no longer be reachable past the hole
+                for(std::size_t j = (i + 1) & (capacity - 1); keys[j] != 0; j = (j + 1) & (capacity - 1)){
+                    if(((j - home(keys[j])) & (capacity - 1)) >= ((j - i) & (capacity - 1))){
+                        keys[i] = keys[j];
+                        new (&values[i]) V(std::move(value_at(j)));
+                        value_at(j).~V();
+                        i = j;
+                    }
+                }
+                keys[i] = 0;
+                return true;
+            }
+
+            void clear() {
+                destroy();
+                for(std::size_t i = 0; i < capacity; ++i)
+                    keys[i] = 0;
+                count = 0;
+            }
+
+            // drop the entries and the arrays, call before resetting the arena they came from
+            void release() {
+                destroy();
+                free_arrays(keys, values);
+                keys = nullptr;
+                values = nullptr;
+                capacity = 0;
+                count = 0;
+                shift = 32;
+            }
+
+            std::size_t size() const { return count; }
+            bool empty() const { return count == 0; }
+
+            iterator begin() { return iterator(this, 0); }
+            iterator end() { return iterator(this, capacity); }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_FLAT_MAP_HPP
@@ -0,0 +1,434 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_LOCK_TABLE_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_LOCK_TABLE_HPP
+// file: lock_table.hpp
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <algorithm>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <chrono>
+#include "rwlock.hpp"
+
+namespace locktable
+{
+    typedef uint32_t Key;   // interned account id
+    typedef uint32_t Owner; // interned transaction (client) id
+    constexpr Owner NO_OWNER = 0;
+
+    // start timestamp of a transaction with its client id to break ties, the smaller one is older
+    typedef std::pair<uint64_t, std::string> Age;
+
+    // what a transaction does when it finds a lock held by another one
+    enum class DeadlockPolicy {
+        DETECT,     // wait, cycles are broken by the external detector
+        WOUND_WAIT, // an older requester aborts the younger holders and waits, a younger one waits
+        WAIT_DIE    // an older requester waits, a younger one aborts itself
+    };
+
+    inline bool parse_deadlock_policy(const std::string &name, DeadlockPolicy &policy) {
+        if(name == "detect")
+            policy = DeadlockPolicy::DETECT;
+        else if(name == "wound-wait")
+            policy = DeadlockPolicy::WOUND_WAIT;
+        else if(name == "wait-die")
+            policy = DeadlockPolicy::WAIT_DIE;
+        else
+            return false;
+        return true;
+    }
+
+    /*
+     * Lock table keyed by account. The table is split into partitions by key so that lookups on different
+     * accounts rarely meet on the same mutex. An entry only exists while somebody holds or waits for its lock;
+     * afterwards it goes back to its partition's free list and is reused for another account.
+     *
+     * Each entry records who holds it: any number of readers or one writer. Asking again for a lock already
+     * held (or covered by a held write lock) is free, and a reader that asks for the write lock is upgraded in
+     * place once it is the only reader left, instead of waiting on its own read lock.
+     *
+     * Increment locks are for commutative updates (escrow deposits and reserved withdrawals): any number of
+     * owners may hold one together, but they exclude readers and writers. An owner holds one mode at a time,
+     * so a reader asking for an increment lock or an incrementer asking to read is upgraded to the write lock.
+     *
+     * Under wound-wait or wait-die a conflict is settled on the spot by the transactions' ages, so no wait
+     * cycle can form. Transactions register their age and cancellation token with begin_transaction().
+     * A transaction that voted yes is marked prepared and is never wounded any more, its coordinator may have
+     * decided to commit it. It may still be collecting locks on another server, so an older requester does
+     * not wait for it either but dies, like under wait-die; that keeps every wait younger-for-older.
+     *
+     * A wait may also have a deadline, so a dead or slow holder cannot pin its waiters forever; a transaction
+     * that times out is cancelled like a deadlock victim and the timeout is counted against the account.
+     */
+    class LockTable {
+        private:
+            struct LockEntry {
+                Owner write_holder = NO_OWNER;
+                std::vector<Owner> read_holders;
+                std::vector<Owner> increment_holders;
+                int upgrading = 0; // holders waiting to become the writer, new readers queue behind them
+                std::vector<Owner> waiters;
+                int pins = 0;      // held locks and waiters, the entry is recycled when it drops to 0
+                std::condition_variable cond;
+
+                bool reads(Owner owner) const {
+                    return std::find(read_holders.begin(), read_holders.end(), owner) != read_holders.end();
+                }
+
+                bool increments(Owner owner) const {
+                    return std::find(increment_holders.begin(), increment_holders.end(), owner) != increment_holders.end();
+                }
+
+                // nobody but owner holds the lock in any mode
+                bool only_holder(Owner owner) const {
+                    return (write_holder == NO_OWNER || write_holder == owner) &&
+                           std::all_of(read_holders.begin(), read_holders.end(), [&](Owner o) {return o == owner; }) &&
+                           std::all_of(increment_holders.begin(), increment_holders.end(), [&](Owner o) {return o == owner; });
+                }
+
+                std::vector<Owner> holders() const {
+                    std::vector<Owner> all = read_holders;
+                    all.insert(all.end(), increment_holders.begin(), increment_holders.end());
+                    if(write_holder != NO_OWNER)
+                        all.push_back(write_holder);
+                    return all;
+                }
+            };
+
+            struct Partition {
+                std::mutex mx; // guards every entry of the partition
+                std::unordered_map<Key, LockEntry*> entries;
+                std::deque<LockEntry> slab; // entries never move or die, so waiters may keep pointers
+                std::vector<LockEntry*> free_entries;
+                std::unordered_map<Key, uint64_t> timeouts; // lock waits given up per account, kept forever
+
+                LockEntry* pin(Key key) {
+                    LockEntry* &e = entries[key];
+                    if(e == nullptr){
+                        if(free_entries.empty()){
+                            slab.emplace_back();
+                            e = &slab.back();
+                        }else{
+                            e = free_entries.back();
+                            free_entries.pop_back();
+                        }
+                    }
+                    ++e->pins;
+                    return e;
+                }
+
+                void unpin(Key key, LockEntry* e) {
+                    if(--e->pins == 0){
+                        entries.erase(key);
+                        free_entries.push_back(e);
+                    }
+                }
+            };
+
+            std::vector<Partition> partitions;
+            DeadlockPolicy policy = DeadlockPolicy::DETECT;
+            std::chrono::milliseconds wait_timeout{0}; // 0 waits forever
+
+            struct TransactionInfo {
+                Age age;
+                rwlock::CancellationToken *token;
+                bool prepared; // voted yes, never wounded
+            };
+            std::mutex transactions_mx; // never taken while a partition is held
+            std::unordered_map<Owner, TransactionInfo> transactions;
+            std::function<void(Owner)> on_wound;
+
+            Partition & partition_of(Key key) {
+                return partitions[key % partitions.size()];
+            }
+
+            // apply the policy to owner's conflict with the holders of e, false if owner has to die;
+            // p is unlocked meanwhile, a wounded holder may be waiting on this very partition
+            bool settle_conflict(std::unique_lock<std::mutex> &lock, LockEntry *e, Owner owner) {
+                std::vector<Owner> holders = e->holders();
+                lock.unlock();
+                bool wait = true;
+                {
+                    std::lock_guard<std::mutex> registry_lock(transactions_mx);
+                    auto self = transactions.find(owner);
+                    for(Owner holder: holders){
+                        auto other = transactions.find(holder);
+                        if(self == transactions.end() || holder == owner || other == transactions.end())
+                            continue; // no age known, just wait
+                        bool older = self->second.age < other->second.age;
+                        if(policy == DeadlockPolicy::WOUND_WAIT && older && other->second.prepared){
+                            wait = false; // cannot wound it, and waiting could close a cycle through another server
+                            break;
+                        }else if(policy == DeadlockPolicy::WOUND_WAIT && older){
+                            other->second.token->cancel();
+                            if(on_wound)
+                                on_wound(holder); // the holder may be idle, it has to give its locks up itself
+                        }else if(policy == DeadlockPolicy::WAIT_DIE && !older){
+                            wait = false;
+                            break;
+                        }
+                    }
+                }
+                lock.lock();
+                return wait;
+            }
+
+            // sleep until woken or the deadline passes, false on timeout
+            bool sleep(std::unique_lock<std::mutex> &lock, LockEntry *e,
+                       const std::chrono::steady_clock::time_point &deadline) {
+                if(wait_timeout.count() == 0){
+                    e->cond.wait(lock);
+                    return true;
+                }
+                return e->cond.wait_until(lock, deadline) == std::cv_status::no_timeout;
+            }
+
+            // sleep on e until granted() holds, false if the token is cancelled or the wait times out first
+            template <typename Granted>
+            bool wait_until(Partition &p, std::unique_lock<std::mutex> &lock, Key key, LockEntry *e, Owner owner,
+                            rwlock::CancellationToken *token, Granted granted) {
+                if(granted())
+                    return true;
+                e->waiters.push_back(owner); // visible to wait_for_edges() while asleep
+                auto deadline = std::chrono::steady_clock::now() + wait_timeout;
+                bool acquired = true;
+                if(token == nullptr){
+                    while(!granted()){
+                        if(!sleep(lock, e, deadline) && !granted()){
+                            ++p.timeouts[key];
+                            acquired = false;
+                            break;
+                        }
+                    }
+                }else{
+                    token->begin_wait(&p.mx, &e->cond);
+                    bool settle = policy != DeadlockPolicy::DETECT; // again whenever the holders may have changed
+                    while(!granted()){
+                        if(token->is_cancelled()){
+                            acquired = false;
+                            break;
+                        }
+                        if(settle){
+                            settle = false;
+                            if(!settle_conflict(lock, e, owner)){
+                                acquired = false;
+                                break;
+                            }
+                            continue; // p was unlocked, check again before sleeping
+                        }
+                        if(!sleep(lock, e, deadline) && !granted()){
+                            ++p.timeouts[key];
+                            acquired = false;
+                            break;
+                        }
+                        settle = policy != DeadlockPolicy::DETECT;
+                    }
+                    token->end_wait();
+                    if(!acquired)
+                        token->cancel(); // no longer registered, only marks the transaction as aborted
+                }
+                e->waiters.erase(std::find(e->waiters.begin(), e->waiters.end(), owner));
+                return acquired;
+            }
+
+            // owner holds a read or increment lock on e and needs it exclusively; the held lock's pin becomes the
+            // write lock's
+            bool upgrade(Partition &p, std::unique_lock<std::mutex> &lock, Key key, LockEntry *e, Owner owner,
+                         rwlock::CancellationToken *token) {
+                ++e->upgrading;
+                bool granted = wait_until(p, lock, key, e, owner, token, [&]() {return e->only_holder(owner); });
+                --e->upgrading;
+                if(!granted){
+                    e->cond.notify_all(); // readers and incrementers may have queued behind the upgrade
+                    return false;
+                }
+                e->read_holders.clear();
+                e->increment_holders.clear();
+                e->write_holder = owner;
+                return true;
+            }
+
+        public:
+            explicit LockTable(std::size_t num_partitions = 64) : partitions(num_partitions) {}
+
+            LockTable(const LockTable &) = delete;
+            LockTable & operator=(const LockTable &) = delete;
+
+            // set before any lock is taken
+            void set_policy(DeadlockPolicy policy_) {
+                policy = policy_;
+            }
+
+            // deadline of every lock wait, 0 for none; set before any lock is taken
+            void set_wait_timeout(std::chrono::milliseconds timeout) {
+                wait_timeout = timeout;
+            }
+
+            // called with the wounded owner, under the transaction registry but no partition
+            void set_wound_handler(std::function<void(Owner)> handler) {
+                on_wound = std::move(handler);
+            }
+
+            // owner's age and token for wound-wait / wait-die, the first registration of a transaction wins;
+            // token must stay valid until end_transaction(owner)
+            void begin_transaction(Owner owner, const Age &age, rwlock::CancellationToken *token) {
+                std::lock_guard<std::mutex> registry_lock(transactions_mx);
+                transactions.emplace(owner, TransactionInfo{age, token, false});
+            }
+
+            // owner votes yes: from now on it is not wounded. False if it was wounded before, it has to vote no
+            bool prepare_transaction(Owner owner) {
+                std::lock_guard<std::mutex> registry_lock(transactions_mx);
+                auto it = transactions.find(owner);
+                if(it == transactions.end())
+                    return true; // no age known, nobody wounds it
+                if(it->second.token->is_cancelled())
+                    return false;
+                it->second.prepared = true;
+                return true;
+            }
+
+            bool prepared(Owner owner) {
+                std::lock_guard<std::mutex> registry_lock(transactions_mx);
+                auto it = transactions.find(owner);
+                return it != transactions.end() && it->second.prepared;
+            }
+
+            void end_transaction(Owner owner) {
+                std::lock_guard<std::mutex> registry_lock(transactions_mx);
+                transactions.erase(owner);
+            }
+
+            // false if the token was cancelled while waiting
+            bool write_lock(Key key, Owner owner, rwlock::CancellationToken *token = nullptr) {
+                Partition &p = partition_of(key);
+                std::unique_lock<std::mutex> lock(p.mx);
+                LockEntry *e = p.pin(key);
+                if(e->write_holder == owner){
+                    p.unpin(key, e);
+                    return true;
+                }
+                if(e->reads(owner) || e->increments(owner)){
+                    p.unpin(key, e);
+                    return upgrade(p, lock, key, e, owner, token);
+                }
+                if(!wait_until(p, lock, key, e, owner, token, [&]() {
+                        return e->write_holder == NO_OWNER && e->read_holders.empty() && e->increment_holders.empty(); })){
+                    p.unpin(key, e);
+                    return false;
+                }
+                e->write_holder = owner; // the pin is kept while the lock is held
+                return true;
+            }
+
+            bool read_lock(Key key, Owner owner, rwlock::CancellationToken *token = nullptr) {
+                Partition &p = partition_of(key);
+                std::unique_lock<std::mutex> lock(p.mx);
+                LockEntry *e = p.pin(key);
+                if(e->write_holder == owner || e->reads(owner)){
+                    p.unpin(key, e);
+                    return true;
+                }
+                if(e->increments(owner)){
+                    p.unpin(key, e);
+                    return upgrade(p, lock, key, e, owner, token);
+                }
+                if(!wait_until(p, lock, key, e, owner, token, [&]() {
+                        return e->write_holder == NO_OWNER && e->increment_holders.empty() && e->upgrading == 0; })){
+                    p.unpin(key, e);
+                    return false;
+                }
+                e->read_holders.push_back(owner);
+                return true;
+            }
+
+            bool increment_lock(Key key, Owner owner, rwlock::CancellationToken *token = nullptr) {
+                Partition &p = partition_of(key);
+                std::unique_lock<std::mutex> lock(p.mx);
+                LockEntry *e = p.pin(key);
+                if(e->write_holder == owner || e->increments(owner)){
+                    p.unpin(key, e);
+                    return true;
+                }
+                if(e->reads(owner)){
+                    p.unpin(key, e);
+                    return upgrade(p, lock, key, e, owner, token);
+                }
+                if(!wait_until(p, lock, key, e, owner, token, [&]() {
+                        return e->write_holder == NO_OWNER && e->read_holders.empty() && e->upgrading == 0; })){
+                    p.unpin(key, e);
+                    return false;
+                }
+                e->increment_holders.push_back(owner);
+                return true;
+            }
+
+            // drop every lock owner holds on key
+            void release(Key key, Owner owner) {
+                Partition &p = partition_of(key);
+                std::lock_guard<std::mutex> lock(p.mx);
+                auto it = p.entries.find(key);
+                if(it == p.entries.end())
+                    return;
+                LockEntry *e = it->second;
+                int released = 0;
+                if(e->write_holder == owner){
+                    e->write_holder = NO_OWNER;
+                    ++released;
+                }
+                auto reader = std::find(e->read_holders.begin(), e->read_holders.end(), owner);
+                if(reader != e->read_holders.end()){
+                    e->read_holders.erase(reader);
+                    ++released;
+                }
+                auto incrementer = std::find(e->increment_holders.begin(), e->increment_holders.end(), owner);
+                if(incrementer != e->increment_holders.end()){
+                    e->increment_holders.erase(incrementer);
+                    ++released;
+                }
+                if(released == 0)
+                    return;
+                e->cond.notify_all();
+                while(released-- > 0)
+                    p.unpin(key, e);
+            }
+
+            // local wait-for graph: (waiter, holder) for every transaction blocked behind another one
+            std::vector<std::pair<Owner, Owner>> wait_for_edges() {
+                std::vector<std::pair<Owner, Owner>> edges;
+                for(auto &p: partitions){
+                    std::lock_guard<std::mutex> lock(p.mx);
+                    for(auto &key_entry: p.entries){
+                        LockEntry *e = key_entry.second;
+                        std::vector<Owner> holders = e->holders();
+                        for(Owner waiter: e->waiters){
+                            for(Owner holder: holders){
+                                if(holder != waiter)
+                                    edges.push_back(std::make_pair(waiter, holder));
+                            }
+                        }
+                    }
+                }
+                return edges;
+            }
+
+            // lock waits that timed out so far, per account
+            std::vector<std::pair<Key, uint64_t>> timeout_counts() {
+                std::vector<std::pair<Key, uint64_t>> counts;
+                for(auto &p: partitions){
+                    std::lock_guard<std::mutex> lock(p.mx);
+                    counts.insert(counts.end(), p.timeouts.begin(), p.timeouts.end());
+                }
+                return counts;
+            }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_LOCK_TABLE_HPP
@@ -7,64 +7,252 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
+#include <thread>
+#include <cstdint>
 
 namespace rwlock
 {
+    // Cooperative cancellation of one transaction's lock waits. cancel() wakes the lock the owner is blocked
+    // on right away, the wait then returns without the lock instead of the thread being killed inside it.
+    class CancellationToken {
+        private:
+            std::atomic<bool> cancelled{false};
+            std::mutex mx;
+            std::mutex *waiting_mx = nullptr;
+            std::condition_variable *waiting_cond = nullptr;
+        public:
+            bool is_cancelled() const {
+                return cancelled.load();
+            }
+
+            void cancel() {
+                cancelled.store(true);
+                std::mutex *m;
+                std::condition_variable *c;
+                {
+                    std::lock_guard<std::mutex> lock(mx);
+                    m = waiting_mx;
+                    c = waiting_cond;
+                }
+                if(c != nullptr){
+                    // the waiter holds *m until it sleeps, so the wakeup cannot slip in before its check
+                    std::lock_guard<std::mutex> wait_lock(*m);
+                    c->notify_all();
+                }
+            }
+
+            // cancel only a wait in progress, an owner that is not blocked right now is left alone
+            bool cancel_if_waiting() {
+                std::mutex *m;
+                std::condition_variable *c;
+                {
+                    std::lock_guard<std::mutex> lock(mx);
+                    if(waiting_cond == nullptr)
+                        return false;
+                    cancelled.store(true);
+                    m = waiting_mx;
+                    c = waiting_cond;
+                }
+                std::lock_guard<std::mutex> wait_lock(*m);
+                c->notify_all();
+                return true;
+            }
+
+            void reset() {
+                cancelled.store(false);
+            }
+
+            // called by a lock before and after the owner blocks on it, with or without m held;
+            // m and c must outlive the token's use of them
+            void begin_wait(std::mutex *m, std::condition_variable *c) {
+                std::lock_guard<std::mutex> lock(mx);
+                waiting_mx = m;
+                waiting_cond = c;
+            }
+
+            void end_wait() {
+                std::lock_guard<std::mutex> lock(mx);
+                waiting_mx = nullptr;
+                waiting_cond = nullptr;
+            }
+    };
+
+    enum class Preference {
+        READERS, // a waiting writer does not hold back new readers
+        WRITERS  // new readers queue behind a waiting writer
+    };
+
+    /*
+     * Reader/writer lock on one atomic state word: the reader count, the number of waiting writers and a
+     * writer bit. Uncontended acquires and releases are a single compare-and-swap or fetch-add; a thread that
+     * cannot get the lock spins briefly and then parks on the condition variable of its class, readers and
+     * writers apart, and a release only touches the mutex when somebody is parked.
+     */
     class ReadWriteLock {
         private:
-            int readWaiting = 0;
-            int writeWaiting = 0;
-            int reading = 0;
-            int writing = 0;
-            mutable std::mutex mx;
-            mutable std::condition_variable cond;
+            static constexpr uint32_t READER = 1;
+            static constexpr uint32_t READER_MASK = (1u << 20) - 1;
+            static constexpr uint32_t WAITING_WRITER = 1u << 20;
+            static constexpr uint32_t WAITING_MASK = ((1u << 10) - 1) << 20;
+            static constexpr uint32_t WRITER = 1u << 31;
+            static constexpr int SPINS = 64;
+
+            std::atomic<uint32_t> state{0};
+            Preference preference;
+            std::atomic<int> parked_readers{0};
+            std::atomic<int> parked_writers{0};
+            mutable std::mutex mx; // only for parking
+            mutable std::condition_variable read_cond;
+            mutable std::condition_variable write_cond;
+
+            bool can_read(uint32_t s) const {
+                return (s & WRITER) == 0 && (preference == Preference::READERS || (s & WAITING_MASK) == 0);
+            }
+
+            static bool can_write(uint32_t s) {
+                return (s & WRITER) == 0 && (s & READER_MASK) == 0;
+            }
+
+            bool try_read(uint32_t &s) {
+                return can_read(s) && state.compare_exchange_weak(s, s + READER);
+            }
+
+            // a waiting writer already counted itself in the state word
+            bool try_write_waiting(uint32_t &s) {
+                return can_write(s) && state.compare_exchange_weak(s, (s - WAITING_WRITER) | WRITER);
+            }
+
+            void wake_parked() {
+                if(parked_readers.load() == 0 && parked_writers.load() == 0)
+                    return;
+                std::lock_guard<std::mutex> lock(mx);
+                bool writer_waits = (state.load() & WAITING_MASK) != 0;
+                if(preference == Preference::WRITERS && writer_waits){
+                    write_cond.notify_one();
+                    return;
+                }
+                read_cond.notify_all();
+                if(writer_waits)
+                    write_cond.notify_one();
+            }
+
         public:
-            // default constructor
-            ReadWriteLock() = default;
+            explicit ReadWriteLock(Preference preference_ = Preference::READERS) : preference(preference_) {}
             ~ReadWriteLock() = default;
 
-//            // copy ctor
-//            ReadWriteLock(const ReadWriteLock &) = delete;
-//            ReadWriteLock & operator=(const ReadWriteLock &) = delete;
-//
-            // move ctor
-            ReadWriteLock(const ReadWriteLock &&){
+            // move ctor: a fresh unlocked lock with the same preference
+            ReadWriteLock(const ReadWriteLock &&other) : preference(other.preference) {
 
             }
             ReadWriteLock & operator=(const ReadWriteLock &&) = delete;
 
 
 
-            void readLock() {
-                std::unique_lock<std::mutex>lock(mx);
-                ++readWaiting;
-                cond.wait(lock,[&](){return writing <= 0;});
-                ++reading;
-                --readWaiting;
+            // false if the token was cancelled before the lock could be granted
+            bool readLock(CancellationToken *token = nullptr) {
+                uint32_t s = state.load();
+                for(int spin = 0; spin < SPINS; ++spin){
+                    if(try_read(s))
+                        return true;
+                    if(!can_read(s)){
+                        std::this_thread::yield();
+                        s = state.load();
+                    }
+                }
+                if(token != nullptr) token->begin_wait(&mx, &read_cond);
+                bool acquired = true;
+                {
+                    std::unique_lock<std::mutex> lock(mx);
+                    ++parked_readers;
+                    s = state.load();
+                    while(!try_read(s)){
+                        if(token != nullptr && token->is_cancelled()){
+                            acquired = false;
+                            break;
+                        }
+                        if(!can_read(s)){
+                            read_cond.wait(lock);
+                            s = state.load();
+                        }
+                    }
+                    --parked_readers;
+                }
+                if(token != nullptr) token->end_wait();
+                return acquired;
             }
 
-            void writeLock() {
-                std::unique_lock<std::mutex>lock(mx);
-                ++writeWaiting;
-                cond.wait(lock, [&]() {return readWaiting <=0 && reading <= 0 && writing <= 0; });
-                ++writing;
-                --writeWaiting;
+            bool writeLock(CancellationToken *token = nullptr) {
+                uint32_t s = 0;
+                if(state.compare_exchange_strong(s, WRITER))
+                    return true;
+                s = state.fetch_add(WAITING_WRITER) + WAITING_WRITER;
+                for(int spin = 0; spin < SPINS; ++spin){
+                    if(try_write_waiting(s))
+                        return true;
+                    if(!can_write(s)){
+                        std::this_thread::yield();
+                        s = state.load();
+                    }
+                }
+                if(token != nullptr) token->begin_wait(&mx, &write_cond);
+                bool acquired = true;
+                {
+                    std::unique_lock<std::mutex> lock(mx);
+                    ++parked_writers;
+                    s = state.load();
+                    while(!try_write_waiting(s)){
+                        if(token != nullptr && token->is_cancelled()){
+                            acquired = false;
+                            state.fetch_sub(WAITING_WRITER);
+                            read_cond.notify_all(); // readers may have queued behind this writer
+                            break;
+                        }
+                        if(!can_write(s)){
+                            write_cond.wait(lock);
+                            s = state.load();
+                        }
+                    }
+                    --parked_writers;
+                }
+                if(token != nullptr) token->end_wait();
+                return acquired;
             }
 
             void readUnLock() {
-                std::unique_lock<std::mutex>lock(mx);
-                --reading;
-                if(reading<=0)
-                    cond.notify_one();
+                uint32_t prev = state.fetch_sub(READER);
+                if((prev & READER_MASK) == READER && parked_writers.load() > 0){
+                    std::lock_guard<std::mutex> lock(mx);
+                    write_cond.notify_one();
+                }
             }
 
             void writeUnLock() {
-                std::unique_lock<std::mutex>lock(mx);
-                --writing;
-                cond.notify_all();
+                state.fetch_and(~WRITER);
+                wake_parked();
             }
     };
+
+    class ReadGuard {
+        private:
+            ReadWriteLock &rw;
+        public:
+            explicit ReadGuard(ReadWriteLock &rw_) : rw(rw_) { rw.readLock(); }
+            ~ReadGuard() { rw.readUnLock(); }
+            ReadGuard(const ReadGuard &) = delete;
+            ReadGuard & operator=(const ReadGuard &) = delete;
+    };
+
+    class WriteGuard {
+        private:
+            ReadWriteLock &rw;
+        public:
+            explicit WriteGuard(ReadWriteLock &rw_) : rw(rw_) { rw.writeLock(); }
+            ~WriteGuard() { rw.writeUnLock(); }
+            WriteGuard(const WriteGuard &) = delete;
+            WriteGuard & operator=(const WriteGuard &) = delete;
+    };
 }
 
 
@@ -0,0 +1,70 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_SPLIT_COUNTER_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_SPLIT_COUNTER_HPP
+// file: split_counter.hpp
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <sched.h>
+
+namespace splitcounter
+{
+    // Counter striped over one cache line per core: an add only touches the slot of the core it runs on, so
+    // concurrent adds from different cores never contend; reading sums every slot.
+    class SplitCounter {
+        private:
+            static constexpr std::size_t CACHE_LINE = 64;
+            struct alignas(CACHE_LINE) Slot {
+                std::atomic<int64_t> value{0};
+            };
+            std::size_t num_slots;
+            // new[] ignores alignas above alignof(max_align_t) before C++17, so the slots are placed by hand
+            std::unique_ptr<char[]> storage;
+            Slot *slots;
+
+            static Slot * place_slots(char *raw, std::size_t n) {
+                uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + CACHE_LINE - 1) & ~(uintptr_t) (CACHE_LINE - 1);
+                Slot *first = reinterpret_cast<Slot*>(aligned);
+                for(std::size_t i = 0; i < n; ++i)
+                    new (&first[i]) Slot();
+                return first;
+            }
+
+            std::size_t slot_index() const {
+                int cpu = sched_getcpu();
+                if(cpu < 0) // not supported, spread by thread instead
+                    return std::hash<std::thread::id>()(std::this_thread::get_id()) % num_slots;
+                return static_cast<std::size_t>(cpu) % num_slots;
+            }
+
+        public:
+            explicit SplitCounter(int64_t initial = 0, std::size_t num_slots_ = std::thread::hardware_concurrency())
+                : num_slots(num_slots_ == 0 ? 1 : num_slots_), storage(new char[num_slots * sizeof(Slot) + CACHE_LINE]),
+                  slots(place_slots(storage.get(), num_slots)) {
+                slots[0].value.store(initial, std::memory_order_relaxed);
+            }
+
+            SplitCounter(const SplitCounter &) = delete;
+            SplitCounter & operator=(const SplitCounter &) = delete;
+
+            void add(int64_t delta) {
+                slots[slot_index()].value.fetch_add(delta, std::memory_order_relaxed);
+            }
+
+            // exact once the adders are done, a concurrent add may or may not be included
+            int64_t sum() const {
+                int64_t total = 0;
+                for(std::size_t i = 0; i < num_slots; ++i)
+                    total += slots[i].value.load(std::memory_order_relaxed);
+                return total;
+            }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_SPLIT_COUNTER_HPP
@@ -0,0 +1,63 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_STRING_INTERNER_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_STRING_INTERNER_HPP
+// file: string_interner.hpp
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+namespace interning
+{
+    // Maps strings (account and client identifiers) to integer ids, once per string for the life of the
+    // process, so hot paths compare and hash integers instead of strings. Id 0 is never handed out.
+    // The strings are striped by hash over independently locked tables, so handler threads interning
+    // different accounts rarely meet on one mutex; the low bits of an id name its stripe. Those bits are the
+    // string's hash, so tables sharded by id modulo a power of two up to 64 are filled evenly.
+    class StringInterner {
+        private:
+            static constexpr unsigned STRIPE_BITS = 6;
+            static constexpr uint32_t NUM_STRIPES = 1u << STRIPE_BITS;
+            struct alignas(64) Stripe {
+                std::unordered_map<std::string, uint32_t> ids;
+                std::vector<const std::string*> names{nullptr}; // keys of ids, which never move; index 0 unused
+                mutable std::mutex mx;
+            };
+            Stripe stripes[NUM_STRIPES]; // an interner lives in static storage or on the stack, where alignas holds
+
+            static uint32_t stripe_of(const std::string &s) {
+                return (uint32_t) (std::hash<std::string>()(s) & (NUM_STRIPES - 1));
+            }
+
+        public:
+            StringInterner() = default;
+            StringInterner(const StringInterner &) = delete;
+            StringInterner & operator=(const StringInterner &) = delete;
+
+            uint32_t intern(const std::string &s) {
+                uint32_t index = stripe_of(s);
+                Stripe &stripe = stripes[index];
+                std::lock_guard<std::mutex> lock(stripe.mx);
+                auto it = stripe.ids.find(s);
+                if(it != stripe.ids.end())
+                    return it->second;
+                uint32_t id = ((uint32_t) stripe.names.size() << STRIPE_BITS) | index;
+                it = stripe.ids.emplace(s, id).first;
+                stripe.names.push_back(&it->first);
+                return id;
+            }
+
+            const std::string & name(uint32_t id) const {
+                const Stripe &stripe = stripes[id & (NUM_STRIPES - 1)];
+                std::lock_guard<std::mutex> lock(stripe.mx);
+                return *stripe.names[id >> STRIPE_BITS];
+            }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_STRING_INTERNER_HPP
@@ -0,0 +1,141 @@
+#ifndef MP3_DISTRIBUTED_TRANSACTIONS_VERSION_STORE_HPP
+#define MP3_DISTRIBUTED_TRANSACTIONS_VERSION_STORE_HPP
+// file: version_store.hpp
+#pragma once
+
+#include <deque>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+
+namespace mvcc
+{
+    typedef uint32_t Key;     // interned account id
+    typedef uint64_t Version; // commit sequence number of the server, 0 is before the first commit
+
+    /*
+     * Committed balances of every account, a few versions deep. Each commit gets the next version number and
+     * writes all of its accounts under it, so reading every account as of one version gives a consistent
+     * snapshot that no lock holder can block. A version is dropped once a newer one exists that every open
+     * snapshot can see; this happens lazily, when its account is committed to again.
+     *
+     * The accounts are striped by key over independently locked tables, so reads and commits of different
+     * accounts do not meet on one mutex. A commit holds the stripes of all its accounts while it takes its
+     * version, which keeps every account's history in version order, and snapshots only open at a version
+     * once every commit up to it is installed.
+     */
+    class VersionStore {
+        private:
+            static constexpr std::size_t NUM_STRIPES = 64;
+            typedef std::deque<std::pair<Version, int>> History; // oldest first
+            struct alignas(64) Stripe {
+                std::mutex mx;
+                std::unordered_map<Key, History> versions;
+            };
+            Stripe stripes[NUM_STRIPES]; // the store is a member of a global, where alignas holds
+            std::atomic<Version> next_version{0};   // last version handed to a commit
+            std::atomic<Version> last_committed{0}; // every version up to it is installed
+            std::mutex snapshots_mx; // taken once per snapshot and once per commit, never per account
+            std::multiset<Version> open_snapshots;
+
+            Stripe & stripe_of(Key key) {
+                return stripes[key % NUM_STRIPES];
+            }
+
+            // versions an open snapshot may still read are newer than the one visible at the returned version
+            Version oldest_visible() {
+                std::lock_guard<std::mutex> lock(snapshots_mx);
+                return open_snapshots.empty() ? last_committed.load() : *open_snapshots.begin();
+            }
+
+            // keep the newest version visible at oldest and everything after it
+            static void collect(History &history, Version oldest) {
+                while(history.size() > 1 && history[1].first <= oldest)
+                    history.pop_front();
+            }
+
+        public:
+            VersionStore() = default;
+            VersionStore(const VersionStore &) = delete;
+            VersionStore & operator=(const VersionStore &) = delete;
+
+            // the latest committed state, readable until close_snapshot()
+            Version open_snapshot() {
+                std::lock_guard<std::mutex> lock(snapshots_mx);
+                Version snapshot = last_committed.load();
+                open_snapshots.insert(snapshot);
+                return snapshot;
+            }
+
+            void close_snapshot(Version snapshot) {
+                std::lock_guard<std::mutex> lock(snapshots_mx);
+                auto it = open_snapshots.find(snapshot);
+                if(it != open_snapshots.end())
+                    open_snapshots.erase(it);
+            }
+
+            // the balance of key as of snapshot and the version it was written by, false if it did not exist yet
+            bool read(Key key, Version snapshot, int &amount, Version &version) {
+                Stripe &stripe = stripe_of(key);
+                std::lock_guard<std::mutex> lock(stripe.mx);
+                auto it = stripe.versions.find(key);
+                if(it == stripe.versions.end())
+                    return false;
+                for(auto v = it->second.rbegin(); v != it->second.rend(); ++v){
+                    if(v->first <= snapshot){
+                        amount = v->second;
+                        version = v->first;
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // version of the last commit to key, 0 if it was never committed
+            Version latest(Key key) {
+                Stripe &stripe = stripe_of(key);
+                std::lock_guard<std::mutex> lock(stripe.mx);
+                auto it = stripe.versions.find(key);
+                return it == stripe.versions.end() || it->second.empty() ? 0 : it->second.back().first;
+            }
+
+            // install the net changes of one transaction as a new version on top of the latest balances. Adding
+            // under the stripe locks keeps concurrent commits to one account (escrow) in version order,
+            // whatever order they computed their results in
+            Version commit(const std::vector<std::pair<Key, int>> &deltas) {
+                Version oldest = oldest_visible(); // read first, an older bound only keeps more versions
+                bool held[NUM_STRIPES] = {};
+                for(auto &delta: deltas)
+                    held[delta.first % NUM_STRIPES] = true;
+                for(std::size_t i = 0; i < NUM_STRIPES; ++i) // in index order, so commits never deadlock
+                    if(held[i])
+                        stripes[i].mx.lock();
+                Version version = ++next_version;
+                for(auto &delta: deltas){
+                    History &history = stripe_of(delta.first).versions[delta.first];
+                    history.emplace_back(version, (history.empty() ? 0 : history.back().second) + delta.second);
+                    collect(history, oldest);
+                }
+                for(std::size_t i = 0; i < NUM_STRIPES; ++i)
+                    if(held[i])
+                        stripes[i].mx.unlock();
+                // publish in version order: the commits before this one hold their stripes already and finish
+                // without waiting for anything this one holds
+                Version previous = version - 1;
+                while(!last_committed.compare_exchange_weak(previous, version)){
+                    previous = version - 1;
+                    std::this_thread::yield();
+                }
+                return version;
+            }
+    };
+}
+
+
+#endif //MP3_DISTRIBUTED_TRANSACTIONS_VERSION_STORE_HPP
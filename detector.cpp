@@ -0,0 +1,129 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include "message_base.h"
+#include "common/json.hpp"
+#define NUM_SERVERS 5
+using namespace std;
+using json = nlohmann::json;
+
+/*
+ * Distributed deadlock detector: polls every server for its local wait-for edges (waiting transaction -> lock
+ * holder), merges them into the global wait-for graph and breaks every cycle by picking a victim. The servers
+ * wake the victim's lock wait and its client aborts the transaction everywhere.
+ */
+
+typedef map<string, set<string>> WaitForGraph;
+
+// depth first search for one cycle, returned in path order
+bool find_cycle(const WaitForGraph& graph, vector<string>& cycle){
+    map<string,int> state; // 0 unvisited, 1 on the current path, 2 done
+    vector<pair<string, set<string>::const_iterator>> path;
+    for(auto& node: graph){
+        if(state[node.first]!=0) continue;
+        state[node.first] = 1;
+        path.push_back(make_pair(node.first, node.second.begin()));
+        while(!path.empty()){
+            auto& top = path.back();
+            auto edges = graph.find(top.first);
+            if(edges==graph.end() || top.second==edges->second.end()){
+                state[top.first] = 2;
+                path.pop_back();
+                continue;
+            }
+            string next = *(top.second++);
+            if(state[next]==1){
+                cycle.clear();
+                auto it = path.begin();
+                while(it->first!=next) ++it;
+                for(; it!=path.end(); ++it) cycle.push_back(it->first);
+                return true;
+            }
+            if(state[next]==0){
+                state[next] = 1;
+                auto next_edges = graph.find(next);
+                path.push_back(make_pair(next, next_edges==graph.end() ? set<string>::const_iterator() : next_edges->second.begin()));
+            }
+        }
+    }
+    return false;
+}
+
+// the victim of a cycle: the largest client ID, so every run picks the same one
+vector<string> choose_victims(WaitForGraph graph){
+    vector<string> victims;
+    vector<string> cycle;
+    while(find_cycle(graph, cycle)){
+        string victim = *max_element(cycle.begin(), cycle.end());
+        victims.push_back(victim);
+        graph.erase(victim);
+        for(auto& node: graph){
+            node.second.erase(victim);
+        }
+    }
+    return victims;
+}
+
+// detector
+int main(int argc, char const *argv[]) {
+    string config_file;
+    vector<message_base::ServerInfo> sinfo;
+    int interval_ms = 500;
+    if(argc==2 || argc==3){
+        config_file = argv[1];
+        if(argc==3){
+            interval_ms = stoi(argv[2]); // optional polling interval
+        }
+
+        ifstream configfilestream(config_file);
+        string node_identifier, node_address;
+        unsigned int port_no;
+        if (configfilestream.is_open()) {
+            cout << "config file open successful" << endl;
+            for (int i = 0; i < NUM_SERVERS; ++i) {
+                message_base::ServerInfo temp_sinfo;
+                configfilestream >> node_identifier >> node_address >> port_no;
+                temp_sinfo.server_identifier = string(node_identifier);
+                temp_sinfo.server_address = HostToIp(string(node_address));
+                temp_sinfo.server_port = port_no;
+                sinfo.push_back(temp_sinfo);
+            }
+        }
+    } else {
+        cout << "config file open error" << endl;
+        return 0;
+    }
+
+    message_base::MessageBaseClient detector(sinfo);
+    json waits_for_rpc = json{{"clientID", message_base::DETECTOR_ID},
+                              {"type", message_base::WAITS_FOR}};
+    while(true){
+        this_thread::sleep_for(chrono::milliseconds(interval_ms));
+        if(!detector.multicast(waits_for_rpc)) continue;
+
+        WaitForGraph graph;
+        for(auto& server_info: sinfo){
+            json rpl = detector.client_recv(server_info.server_identifier);
+            if(!rpl.contains("edges")){
+                cout << "server " << server_info.server_identifier << " is gone" << endl;
+                return 0;
+            }
+            for(auto& edge: rpl["edges"]){
+                graph[edge[0].get<string>()].insert(edge[1].get<string>());
+            }
+        }
+
+        for(auto& victim: choose_victims(graph)){
+            cout << "deadlock, aborting " << victim << endl;
+            detector.multicast(json{{"clientID", message_base::DETECTOR_ID},
+                                    {"type", message_base::VICTIM},
+                                    {"victim", victim}});
+        }
+    }
+}
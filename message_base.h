@@ -10,6 +10,9 @@
 #include <cstdlib>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -22,12 +25,18 @@
 #include <thread>
 #include <pthread.h>
 #include <mutex>
+#include <memory>
 #include <atomic>
 #include <map>
+#include <unordered_map>
 #include <unistd.h>
 #include <iomanip>
 #include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include "common/json.hpp"
+#include "common/buffer_pool.hpp"
+#include "common/rwlock.hpp"
 using json = nlohmann::json;
 using namespace std;
 
@@ -50,17 +59,309 @@ std::string HostToIp(const std::string& host) {
 namespace message_base {
     constexpr unsigned int PORT = 1234;
     constexpr char ADDRESS[] = "0.0.0.0";
-    constexpr unsigned int BUFFER_SIZE = 5*1024*1024;
+    constexpr unsigned int BUFFER_SIZE = 5*1024*1024; // upper bound of a single message payload
+    constexpr unsigned int FRAME_LENGTH_SIZE = 4;
+    constexpr unsigned int FRAME_HEADER_SIZE = FRAME_LENGTH_SIZE + 1; // length + codec byte
+    constexpr uint8_t FRAME_ABORT_FLAG = 0x80; // in the codec byte of an ABORT, readable without decoding
+    constexpr unsigned int RECV_CHUNK_SIZE = 4096;
+    constexpr unsigned int NUM_IO_THREADS = 2;
+    constexpr unsigned int MAX_EPOLL_EVENTS = 64;
     const string BEGIN = "BEGIN";
     const string DEPOSIT = "DEPOSIT";
     const string BALANCE = "BALANCE";
     const string WITHDRAW = "WITHDRAW";
     const string COMMIT = "COMMIT";
     const string ABORT = "ABORT";
+    // deadlock detector <-> server
+    const string DETECTOR_ID = "detector";
+    const string WAITS_FOR = "WAITS_FOR"; // reply carries the server's wait-for edges
+    const string VICTIM = "VICTIM";       // abort the transaction of the named client, no reply
+    const string LOCK_STATS = "LOCK_STATS"; // reply carries the lock wait timeouts per account
+
+    /*
+     * Wire codec of a message. The client picks one per connection and the server answers every request in the
+     * codec it came in, so both encodings can be served side by side.
+     */
+    enum class WireCodec : uint8_t {
+        JSON_TEXT = 0, // json::dump / json::parse
+        MSGPACK = 1,   // json::to_msgpack / json::from_msgpack, no text formatting or number parsing
+    };
+
+    inline bool parse_wire_codec(const string& name, WireCodec& codec){
+        if(name=="json"){
+            codec = WireCodec::JSON_TEXT;
+        }else if(name=="msgpack"){
+            codec = WireCodec::MSGPACK;
+        }else{
+            return false;
+        }
+        return true;
+    }
+
+    inline json decode_message(const char* data, size_t len, WireCodec codec){
+        if(codec==WireCodec::MSGPACK){
+            return json::from_msgpack(data, data+len);
+        }
+        return json::parse(data, data+len);
+    }
+
+    /*
+     * Message framing: every message on the wire is a 4-byte big-endian payload length and a codec byte followed
+     * by the payload. The codec byte also carries FRAME_ABORT_FLAG, so a server can act on an ABORT as soon as
+     * it arrives while leaving every payload to be decoded later. TCP is a byte stream, so one recv() may return
+     * half a message or several messages back to back.
+     */
+    inline bool send_all(int fd, const char* data, size_t len){
+        while(len>0){
+            ssize_t n = ::send(fd, (const void *) data, len, MSG_NOSIGNAL);
+            if(n<0){
+                if(errno==EINTR) continue;
+                if(errno==EAGAIN || errno==EWOULDBLOCK){ // non-blocking socket with a full send buffer
+                    struct pollfd pfd = {fd, POLLOUT, 0};
+                    ::poll(&pfd, 1, -1);
+                    continue;
+                }
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // serialize j right behind the header so header and payload go out in one write; Json is json or another
+    // nlohmann::basic_json, like one whose nodes come from an arena
+    template <typename Json>
+    inline void encode_frame(string& frame, const Json& j, WireCodec codec){
+        frame.assign(FRAME_HEADER_SIZE, '\0');
+        if(codec==WireCodec::MSGPACK){
+            Json::to_msgpack(j, nlohmann::detail::output_adapter<char>(frame));
+        }else{
+            frame += j.dump();
+        }
+        uint32_t len = htonl((uint32_t) (frame.size()-FRAME_HEADER_SIZE));
+        memcpy(&frame[0], &len, FRAME_LENGTH_SIZE);
+        auto type = j.find("type");
+        bool is_abort = type!=j.end() && *type==ABORT;
+        frame[FRAME_LENGTH_SIZE] = (char) ((uint8_t) codec | (is_abort ? FRAME_ABORT_FLAG : 0));
+    }
+
+    /*
+     * Reassembly buffer of one connection, frames are cut out of the received byte stream.
+     * The buffer is borrowed from the buffer pool when bytes arrive and handed back as soon as every received
+     * byte has been consumed, so an idle connection holds no receive memory and a busy one reuses a warm buffer
+     * grown to its actual message size.
+     */
+    class FrameReader {
+        private:
+            string buffer;
+            size_t read_pos = 0;  // start of the first unconsumed byte
+            size_t write_pos = 0; // end of the received bytes
+
+            void release_buffer(){
+                if(buffer.capacity()>0){
+                    bufferpool::default_pool().release(std::move(buffer));
+                    buffer = string();
+                }
+                read_pos = write_pos = 0;
+            }
+
+        public:
+            FrameReader() = default;
+            FrameReader(const FrameReader &) = default;
+            FrameReader & operator=(const FrameReader &) = default;
+            ~FrameReader(){
+                release_buffer();
+            }
+
+            // cut one complete frame out of the bytes received so far, is_abort tells if it is an ABORT
+            bool next_frame(string& payload, WireCodec& codec, bool& is_abort){
+                if(write_pos-read_pos<FRAME_HEADER_SIZE) return false;
+                uint32_t len;
+                memcpy(&len, &buffer[read_pos], FRAME_LENGTH_SIZE);
+                len = ntohl(len);
+                if(write_pos-read_pos<FRAME_HEADER_SIZE+len) return false;
+                uint8_t codec_byte = (uint8_t) buffer[read_pos+FRAME_LENGTH_SIZE];
+                codec = (WireCodec) (codec_byte & ~FRAME_ABORT_FLAG);
+                is_abort = (codec_byte & FRAME_ABORT_FLAG)!=0;
+                payload.assign(&buffer[read_pos+FRAME_HEADER_SIZE], len);
+                read_pos += FRAME_HEADER_SIZE+len;
+                if(read_pos==write_pos){
+                    release_buffer();
+                }
+                return true;
+            }
+
+            // one recv() appended to the buffer, returns what recv() returns
+            ssize_t fill(int fd){
+                if(write_pos==0 && buffer.capacity()==0){
+                    buffer = bufferpool::default_pool().acquire();
+                }
+                if(read_pos>0 && buffer.size()-write_pos<RECV_CHUNK_SIZE){ // compact before growing
+                    memmove(&buffer[0], &buffer[read_pos], write_pos-read_pos);
+                    write_pos -= read_pos;
+                    read_pos = 0;
+                }
+                if(buffer.size()-write_pos<RECV_CHUNK_SIZE){
+                    buffer.resize(max(write_pos+RECV_CHUNK_SIZE, buffer.capacity())); // use all of a warm buffer
+                }
+                ssize_t numbytes;
+                do{
+                    numbytes = ::recv(fd, &buffer[write_pos], buffer.size()-write_pos, 0);
+                }while(numbytes<0 && errno==EINTR);
+                if(numbytes>0){
+                    write_pos += numbytes;
+                }
+                else if(read_pos==write_pos){ // nothing arrived, do not hold a buffer while idle
+                    release_buffer();
+                }
+                return numbytes;
+            }
+
+            // true once the buffered header announces a payload we refuse to buffer
+            bool oversized() const{
+                if(write_pos-read_pos<FRAME_HEADER_SIZE) return false;
+                uint32_t len;
+                memcpy(&len, &buffer[read_pos], FRAME_LENGTH_SIZE);
+                return ntohl(len)>BUFFER_SIZE;
+            }
+
+    };
 
     struct NodeConnection {   // Declare connection struct type
         string node_identifier = "node";
         int send_recv_socket_fd = 0;
+        int session_handle = -1; // slot in the server's connection registry
+        FrameReader reader;
+        shared_ptr<mutex> send_mtx = make_shared<mutex>(); // a frame must not interleave with another one
+        shared_ptr<void> context; // per-connection state owned by the application
+
+        WireCodec codec = WireCodec::JSON_TEXT; // what send_json(j) encodes in, set before the connection is used
+
+        template <typename Json>
+        bool send_json(const Json &j){
+            return send_json(j, codec);
+        }
+
+        // a server answers in the codec of the request, which travels with the request instead of the connection
+        template <typename Json>
+        bool send_json(const Json &j, WireCodec frame_codec){
+            string frame = bufferpool::default_pool().acquire();
+            encode_frame(frame, j, frame_codec);
+            bool sent;
+            {
+                lock_guard<mutex> lock(*send_mtx);
+                sent = send_all(send_recv_socket_fd, frame.data(), frame.size());
+            }
+            bufferpool::default_pool().release(std::move(frame));
+            return sent;
+        }
+
+        // decode the next message already received, false if no whole frame is buffered yet
+        bool next_json(json &j){
+            string payload = bufferpool::default_pool().acquire();
+            WireCodec frame_codec;
+            bool is_abort;
+            bool received = reader.next_frame(payload, frame_codec, is_abort);
+            if(received){
+                j = decode_message(payload.data(), payload.size(), frame_codec);
+            }
+            bufferpool::default_pool().release(std::move(payload));
+            return received;
+        }
+
+        // block until a whole message is received, messages pipelined behind it stay buffered
+        bool recv_json(json &j){
+            while(!next_json(j)){
+                if(reader.oversized()){
+                    printf("frame exceeds %u bytes, dropping connection\n", BUFFER_SIZE);
+                    return false;
+                }
+                if(reader.fill(send_recv_socket_fd)<=0) return false;
+            }
+            return true;
+        }
+    };
+
+    /*
+     * Live connections of a server. Each connection occupies a slot addressed by its integer session handle,
+     * slots of closed connections are reused, and once a client has announced its identifier it is found
+     * through a hash map instead of a scan over all connections.
+     */
+    class ConnectionRegistry {
+        private:
+            vector<shared_ptr<NodeConnection>> slots;
+            vector<int> free_slots;
+            unordered_map<string, shared_ptr<NodeConnection>> connections_by_node_id;
+            mutable rwlock::ReadWriteLock rw; // lookups per message, changes per connection
+
+        public:
+            ConnectionRegistry() = default;
+            ConnectionRegistry(ConnectionRegistry &&other){
+                *this = std::move(other);
+            }
+            // servers are built as temporaries and moved into place before they accept anything
+            ConnectionRegistry & operator=(ConnectionRegistry &&other){
+                rwlock::WriteGuard lock(other.rw);
+                slots = std::move(other.slots);
+                free_slots = std::move(other.free_slots);
+                connections_by_node_id = std::move(other.connections_by_node_id);
+                return *this;
+            }
+
+            shared_ptr<NodeConnection> add(int send_recv_socket_fd){
+                auto nc = make_shared<NodeConnection>();
+                nc->send_recv_socket_fd = send_recv_socket_fd;
+                rwlock::WriteGuard lock(rw);
+                if(free_slots.empty()){
+                    nc->session_handle = (int) slots.size();
+                    slots.push_back(nc);
+                }else{
+                    nc->session_handle = free_slots.back();
+                    free_slots.pop_back();
+                    slots[nc->session_handle] = nc;
+                }
+                return nc;
+            }
+
+            // a reconnecting client takes over its identifier from the stale connection
+            void bind_node_id(NodeConnection* nc, const string& nid){
+                rwlock::WriteGuard lock(rw);
+                nc->node_identifier = nid;
+                connections_by_node_id[nid] = slots[nc->session_handle];
+            }
+
+            shared_ptr<NodeConnection> find(const string& nid) const{
+                rwlock::ReadGuard lock(rw);
+                auto it = connections_by_node_id.find(nid);
+                if(it==connections_by_node_id.end()) return nullptr;
+                return it->second;
+            }
+
+            void remove(NodeConnection* nc){
+                rwlock::WriteGuard lock(rw);
+                auto it = connections_by_node_id.find(nc->node_identifier);
+                if(it!=connections_by_node_id.end() && it->second.get()==nc){
+                    connections_by_node_id.erase(it);
+                }
+                int session_handle = nc->session_handle; // nc may go with the slot's reference
+                slots[session_handle].reset(); // senders still holding it see a closed socket
+                free_slots.push_back(session_handle);
+            }
+
+            vector<shared_ptr<NodeConnection>> identified_connections() const{
+                vector<shared_ptr<NodeConnection>> ncs;
+                rwlock::ReadGuard lock(rw);
+                for(auto& id_nc: connections_by_node_id){
+                    ncs.push_back(id_nc.second);
+                }
+                return ncs;
+            }
+
+            size_t size() const{
+                rwlock::ReadGuard lock(rw);
+                return slots.size()-free_slots.size();
+            }
     };
 
     struct ServerInfo {   // Declare connection struct type
@@ -78,10 +379,11 @@ namespace message_base {
             vector<ServerInfo> server_infos;
 
             MessageBaseClient() = default;
-            MessageBaseClient(vector<ServerInfo> sinfo) : server_infos(sinfo) {
+            MessageBaseClient(vector<ServerInfo> sinfo, WireCodec codec = WireCodec::JSON_TEXT) : server_infos(sinfo) {
                 for(int i=0; i<sinfo.size();i++){
                     NodeConnection nc_new;
                     nc_new.node_identifier = server_infos[i].server_identifier;
+                    nc_new.codec = codec;
                     nodes_connection_group.push_back(nc_new);
                 }
 
@@ -140,11 +442,19 @@ namespace message_base {
                 return -1;
             }
 
+            NodeConnection* get_connection_by_node_id(string nid){
+                for(int i=0; i<nodes_connection_group.size();i++){
+                    if(nodes_connection_group[i].node_identifier==nid){
+                        return &nodes_connection_group[i];
+                    }
+                }
+                return nullptr;
+            }
+
             bool unicast(string server_identifier, const json &j) {
                 DEBUG_INFO("Unicast to server "+server_identifier);
-                int send_recv_socket_fd = this->get_socket_fd_by_node_id(server_identifier);
-                string msg = j.dump();
-                if (::send(send_recv_socket_fd, (const void *) msg.c_str(), msg.length(), 0) < 0) {
+                NodeConnection* nc = this->get_connection_by_node_id(server_identifier);
+                if (nc == nullptr || !nc->send_json(j)) {
                     printf("unicast message error: %s(errno: %d)\n", strerror(errno), errno);
                     return false;
                 }
@@ -162,29 +472,142 @@ namespace message_base {
             }
 
             json client_recv(const string server_identifier){
-                int send_recv_socket_fd = this->get_socket_fd_by_node_id(server_identifier);
-                int numbytes;
-                char buffer[message_base::BUFFER_SIZE];
-                // block until receive
-                if((numbytes = ::recv(send_recv_socket_fd, buffer, message_base::BUFFER_SIZE, 0))>0)
+                NodeConnection* nc = this->get_connection_by_node_id(server_identifier);
+                json rpl;
+                if(nc != nullptr && nc->recv_json(rpl))
                 {
-                    buffer[numbytes] = '\0';
-                    return json::parse(buffer);
+                    return rpl;
                 }
+                return json();
             }
     };
 
+    /*
+     * Event driven server core: the accepting thread hands every client socket (non-blocking) to one of a fixed
+     * set of I/O threads, each multiplexing its connections with epoll. Every payload received is passed undecoded
+     * to the on_frame callback on the I/O thread, so the callback must not block; decoding is left to it.
+     */
     class MessageBaseServer {
         private:
-            array<thread,10> client_thread;
             struct sockaddr_in self_addr;
             struct sockaddr_in addr[10];
+            vector<int> epoll_fds;
+            vector<thread> io_threads;
+            void (*on_frame)(NodeConnection*, string&&, WireCodec, bool) = nullptr; // payload, codec, is an ABORT
+            void (*on_close)(NodeConnection*) = nullptr;
+
+            // hand every whole frame received to on_frame, in a buffer of the buffer pool it now owns
+            void dispatch_frames(NodeConnection* nc){
+                while(true){
+                    string payload = bufferpool::default_pool().acquire();
+                    WireCodec codec;
+                    bool is_abort;
+                    if(!nc->reader.next_frame(payload, codec, is_abort)){
+                        bufferpool::default_pool().release(std::move(payload));
+                        return;
+                    }
+                    on_frame(nc, std::move(payload), codec, is_abort);
+                }
+            }
+
+            // read whatever the socket has and dispatch every whole message, false once the connection is gone
+            bool read_messages(NodeConnection* nc){
+                while(true){
+                    dispatch_frames(nc);
+                    if(nc->reader.oversized()){
+                        printf("frame exceeds %u bytes, dropping connection\n", BUFFER_SIZE);
+                        return false;
+                    }
+                    ssize_t numbytes = nc->reader.fill(nc->send_recv_socket_fd);
+                    if(numbytes>0) continue;
+                    return numbytes<0 && (errno==EAGAIN || errno==EWOULDBLOCK); // drained, wait for the next event
+                }
+            }
+
+            void close_connection(NodeConnection* nc, int epoll_fd){
+                DEBUG_INFO("Client "+nc->node_identifier+" disconnected");
+                ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, nc->send_recv_socket_fd, nullptr);
+                if(on_close != nullptr){
+                    on_close(nc);
+                }
+                {
+                    // the descriptor number may be handed to the next client, nobody may send on it afterwards
+                    lock_guard<mutex> lock(*nc->send_mtx);
+                    ::close(nc->send_recv_socket_fd);
+                    nc->send_recv_socket_fd = -1;
+                }
+                connections.remove(nc);
+            }
+
+            void io_loop(int epoll_fd){
+                struct epoll_event events[MAX_EPOLL_EVENTS];
+                while(true){
+                    int num_events = ::epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+                    if(num_events<0){
+                        if(errno==EINTR) continue;
+                        perror("epoll_wait failed");
+                        exit(EXIT_FAILURE);
+                    }
+                    for(int i=0; i<num_events; i++){
+                        NodeConnection* nc = (NodeConnection*) events[i].data.ptr;
+                        if(!read_messages(nc)){
+                            close_connection(nc, epoll_fd);
+                        }
+                    }
+                }
+            }
+
+            // start the I/O threads and accept connections forever
+            void serve(void (*close_handler)(NodeConnection*), unsigned int num_io_threads){
+                on_close = close_handler;
+                for(unsigned int i=0; i<num_io_threads; i++){
+                    int epoll_fd = ::epoll_create1(0);
+                    if (epoll_fd < 0) {
+                        perror("epoll_create failed");
+                        exit(EXIT_FAILURE);
+                    }
+                    epoll_fds.push_back(epoll_fd);
+                }
+                for(int epoll_fd: epoll_fds){
+                    io_threads.push_back(thread(&MessageBaseServer::io_loop, this, epoll_fd));
+                }
+
+                while(true)
+                {
+                    socklen_t addrlen = sizeof(addr);
+                    struct sockaddr_in client_addr;
+                    int new_sock = accept(listen_socket_fd, (struct sockaddr *) &client_addr, (socklen_t*)&addrlen);
+                    if (new_sock<0)
+                    {
+                        perror("accept failed");
+                        exit(EXIT_FAILURE);
+                    }
+                    else
+                    {
+                        DEBUG_INFO("Accept Client Connection!");
+                        ::fcntl(new_sock, F_SETFL, ::fcntl(new_sock, F_GETFL, 0) | O_NONBLOCK);
+                        inet_ntoa(client_addr.sin_addr);
+                        auto nc_new = connections.add(new_sock);
+
+                        // round robin over the I/O threads, a connection stays on its thread for its lifetime
+                        struct epoll_event ev;
+                        ev.events = EPOLLIN | EPOLLRDHUP;
+                        ev.data.ptr = nc_new.get();
+                        if (::epoll_ctl(epoll_fds[(this->num_accepted++) % epoll_fds.size()], EPOLL_CTL_ADD, new_sock, &ev) < 0) {
+                            perror("epoll_ctl failed");
+                            connections.remove(nc_new.get());
+                            ::close(new_sock);
+                        }
+                    }
+
+                }
+            }
 
         public:
-            array<NodeConnection,10> nodes_connection_group;
+            ConnectionRegistry connections;
             vector<ServerInfo> server_infos;
             int listen_socket_fd;
-            int num_clients = 0;
+            unsigned int num_accepted = 0;
 
             MessageBaseServer() = default;
             MessageBaseServer(string this_server_id, vector<ServerInfo> sinfo) : server_infos(sinfo)
@@ -235,47 +658,27 @@ namespace message_base {
             }
 
             int get_socket_fd_by_node_id(string nid){
-                for(int i=0; i<nodes_connection_group.size();i++){
-                    if(nodes_connection_group[i].node_identifier==nid){
-                        return nodes_connection_group[i].send_recv_socket_fd;
-                    }
-                }
-                return -1;
+                auto nc = connections.find(nid);
+                return nc ? nc->send_recv_socket_fd : -1;
             }
 
+            // called once a client has announced itself so that replies can be routed to it
+            void bind_node_identifier(NodeConnection* nc, const string& nid){
+                connections.bind_node_id(nc, nid);
+            }
 
-
-            void server_start(void (*worker)(NodeConnection*)){
-                while(true)
-                {
-                    socklen_t addrlen = sizeof(addr);
-                    struct sockaddr_in client_addr;
-                    int new_sock = accept(listen_socket_fd, (struct sockaddr *) &client_addr, (socklen_t*)&addrlen);
-                    if (new_sock<0)
-                    {
-                        perror("accept failed");
-                        exit(EXIT_FAILURE);
-                    }
-                    else
-                    {
-                        DEBUG_INFO("Accept Client Connection!");
-                        this->num_clients++;
-                        inet_ntoa(client_addr.sin_addr);
-                        NodeConnection nc_new;
-                        nc_new.send_recv_socket_fd = new_sock;
-                        nodes_connection_group[this->num_clients-1] = nc_new;
-                        client_thread[this->num_clients-1] = thread(worker, &nodes_connection_group[this->num_clients-1]);
-                        client_thread[this->num_clients-1].detach();
-                    }
-
-                }
+            void server_start(void (*frame_handler)(NodeConnection*, string&&, WireCodec, bool),
+                              void (*close_handler)(NodeConnection*) = nullptr,
+                              unsigned int num_io_threads = NUM_IO_THREADS){
+                on_frame = frame_handler;
+                serve(close_handler, num_io_threads);
             }
 
-            bool unicast(string client_identifier, const json &j) {
+            template <typename Json>
+            bool unicast(const string& client_identifier, const Json &j, WireCodec codec) {
                 DEBUG_INFO("Unicast to client "+client_identifier);
-                int send_recv_socket_fd = this->get_socket_fd_by_node_id(client_identifier);
-                string msg = j.dump();
-                if (::send(send_recv_socket_fd, (const void *) msg.c_str(), msg.length(), 0) < 0) {
+                auto nc = connections.find(client_identifier);
+                if (nc == nullptr || !nc->send_json(j, codec)) {
                     printf("unicast message error: %s(errno: %d)\n", strerror(errno), errno);
                     return false;
                 }
@@ -283,8 +686,8 @@ namespace message_base {
             }
 
             bool multicast( const json &j) {
-                for(auto& nc:nodes_connection_group){
-                    if (!unicast(nc.node_identifier, j))
+                for(auto& nc:connections.identified_connections()){
+                    if (!nc->send_json(j))
                     {
                         cout << "cast failed" << endl;
                     }
@@ -10,11 +10,24 @@
 #include <unistd.h>
 #include <atomic>
 #include <map>
+#include <set>
+#include <algorithm>
 #include "message_base.h"
 #include "common/json.hpp"
 #include "common/rwlock.hpp"
+#include "common/blocking_queue.hpp"
+#include "common/string_interner.hpp"
+#include "common/lock_table.hpp"
+#include "common/version_store.hpp"
+#include "common/split_counter.hpp"
+#include "common/arena.hpp"
+#include "common/flat_map.hpp"
+#include "common/balance_reporter.hpp"
 using namespace std;
 using json = nlohmann::json;
+// requests and replies on the handler threads, their nodes come from the session's arena instead of the heap
+typedef nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t, std::uint64_t, double,
+                             arena::ArenaAllocator> rpc_json;
 
 vector<string> parse(string command, char delimiter = ' '){
     vector<string> str_list{};
@@ -32,228 +45,652 @@ vector<string> parse(string command, char delimiter = ' '){
 }
 
 
-rwlock::ReadWriteLock rw_mutex[1000];
-string read_lock_holder[1000];
-string write_lock_holder[1000];
+interning::StringInterner account_ids;
+interning::StringInterner client_ids;
+locktable::LockTable lock_table;
+balancereport::BalanceReporter balance_reporter; // prints the committed balances after commits
+
+// Balance fields are updated by several increment lock holders at once in escrow mode, one mutex per stripe
+array<mutex, 64> balance_mx;
 
 class Balance{
     private:
-        int amount;
-        int mtx_id;
+        int amount;           // including every uncommitted update
+        int committed_amount = 0;
+        bool committed_once = false; // false until its creating transaction commits
+        bool counted_negative = false; // included in Transactions::negative_account_count()
+        int pending_decrease = 0; // withdrawals reserved by uncommitted transactions in escrow mode
+        locktable::Key account_key;
+        // hot account: amount lives in per-core sub-counters, so concurrent escrow deposits skip the stripe
+        atomic<bool> is_split{false};
+        unique_ptr<splitcounter::SplitCounter> split_amount;
+        int contended = 0; // updates that found the stripe taken, counts toward automatic splitting
+
+        mutex & stripe(){
+            return balance_mx[this->account_key % balance_mx.size()];
+        }
+
+        // add to the working amount; false if the stripe is busy and the account is not split
+        bool try_add(int am){
+            if(this->is_split.load()){
+                this->split_amount->add(am);
+                return true;
+            }
+            unique_lock<mutex> lock(this->stripe(), try_to_lock);
+            if(!lock.owns_lock())
+                return false;
+            this->add_locked(am);
+            return true;
+        }
+
+        void add_locked(int am){
+            if(this->is_split.load()){
+                this->split_amount->add(am);
+                return;
+            }
+            this->amount += am;
+        }
+
+        int amount_locked() const {
+            return this->is_split.load() ? static_cast<int>(this->split_amount->sum()) : this->amount;
+        }
+
+        void add(int am){
+            if(this->try_add(am))
+                return;
+            lock_guard<mutex> lock(this->stripe());
+            if(split_after_contention>0 && !this->is_split.load() && ++this->contended>=split_after_contention){
+                this->split_locked();
+            }
+            this->add_locked(am);
+        }
+
+        void split_locked(){
+            if(this->is_split.load())
+                return;
+            this->split_amount.reset(new splitcounter::SplitCounter(this->amount));
+            this->is_split.store(true);
+        }
     public:
-        Balance(int am=0, int mtx_id_=0) {
+        // contended updates after which an account is split by itself, 0 leaves it to split()
+        static int split_after_contention;
+
+        Balance(int am=0, locktable::Key account_key_=0) {
             this->amount = am;
-            this->mtx_id = mtx_id_;
+            this->account_key = account_key_;
         }
-        ~Balance(){
-            rw_mutex[mtx_id].readUnLock();
-            rw_mutex[mtx_id].writeUnLock();
+
+        // stripe the working amount over per-core sub-counters for good
+        void split(){
+            lock_guard<mutex> lock(this->stripe());
+            this->split_locked();
         }
         
-        void roll_back(int tot_am, string client_id){
-            int current_amount = this->amount;
-            DEBUG_INFO("BEFORE ROLEBACK "+ to_string(current_amount));
-            this->amount = current_amount - tot_am;
-            DEBUG_INFO("AFTER ROLEBACK "+ to_string(this->amount));
+        void roll_back(int tot_am, int reserved = 0){
+            lock_guard<mutex> lock(this->stripe());
+            DEBUG_INFO("BEFORE ROLEBACK "+ to_string(this->amount_locked()));
+            this->add_locked(-tot_am);
+            this->pending_decrease -= reserved;
+            DEBUG_INFO("AFTER ROLEBACK "+ to_string(this->amount_locked()));
         }
 
-        void increase(int am, string client_id){
-            if(write_lock_holder[mtx_id] != client_id){
-                rw_mutex[mtx_id].writeLock();
-                write_lock_holder[mtx_id] = client_id;
-            }
-            int current_amount = this->amount;
-            DEBUG_INFO("READ SUCCESS");
-            this->amount = current_amount + am;
+        // make a transaction's updates part of the committed balance
+        void commit(int tot_am, int reserved = 0){
+            lock_guard<mutex> lock(this->stripe());
+            this->committed_amount += tot_am;
+            this->committed_once = true;
+            this->pending_decrease -= reserved;
+        }
+
+        // an account that was never committed is removed again when its creator aborts
+        bool is_committed(){
+            lock_guard<mutex> lock(this->stripe());
+            return this->committed_once;
+        }
+
+        // the caller holds the write lock of account_key, or an increment lock in escrow mode
+        void increase(int am){
+            this->add(am);
             DEBUG_INFO("WRITE SUCCESS");
         }
 
-        void decrease(int am, string client_id){
-            if(write_lock_holder[mtx_id] != client_id){
-                rw_mutex[mtx_id].writeLock();
-                write_lock_holder[mtx_id] = client_id;
-            }
-            int current_amount = this->amount;
-            this->amount = current_amount - am;
+        void decrease(int am){
+            this->add(-am);
+        }
+
+        // escrow withdrawal under an increment lock: only if the balance stays non-negative whatever the other
+        // holders' transactions do, i.e. the committed balance covers every reserved withdrawal
+        bool reserve(int am){
+            lock_guard<mutex> lock(this->stripe());
+            if(this->committed_amount - this->pending_decrease < am)
+                return false;
+            this->pending_decrease += am;
+            this->add_locked(-am);
+            return true;
+        }
+
+        // +1 if the balance went negative since the last call, -1 if it recovered, 0 otherwise
+        int negative_change(){
+            bool negative = this->check_negative();
+            lock_guard<mutex> lock(this->stripe());
+            if(negative==this->counted_negative)
+                return 0;
+            this->counted_negative = negative;
+            return negative ? 1 : -1;
+        }
+
+        bool counted_as_negative(){
+            lock_guard<mutex> lock(this->stripe());
+            return this->counted_negative;
         }
 
         bool check_positive(){
-            if(this->amount>0) return true;
+            if(this->getAmount()>0) return true;
             else return false;
         }
 
         bool check_negative(){
-            if(this->amount<0) return true;
+            if(this->getAmount()<0) return true;
             else return false;
         }
 
-        int getAmount(string client_id){ // for client read
-            if(write_lock_holder[mtx_id] != client_id){
-                rw_mutex[mtx_id].readLock();
-            }
-            return this->amount;
-        }
-
-        int getAmount(){ // for self read
-            return this->amount;
+        int getAmount(){ // the caller holds a lock of account_key, or reads for itself
+            if(this->is_split.load())
+                return static_cast<int>(this->split_amount->sum()); // merged without the stripe
+            lock_guard<mutex> lock(this->stripe());
+            return this->amount_locked();
         }
 
-        void release_locks(){
-            read_lock_holder[mtx_id] = "";
-            write_lock_holder[mtx_id] = "";
-            rw_mutex[mtx_id].writeUnLock();
-            rw_mutex[mtx_id].readUnLock();
-        }
 };
+int Balance::split_after_contention = 0;
 
 // A transaction should see its own tentative updates
 class Transactions{
     private:
-        int num_accounts = 0;
-        map<string, Balance> account_balance;
-        vector<string> account_permanent;
-        map<string, map<string,int>> client_transaction__account_amounts;
-    public:
-        Transactions() = default;
+        // everything one transaction holds on this server, commit and abort only walk this
+        struct TransactionState{
+            arena::Arena arena; // backs the sets below, rewound as a whole when the transaction ends
+            flatmap::FlatMap<int> account_amounts{&arena}; // write-set, account -> net change, each one write (or increment) locked
+            flatmap::FlatMap<bool> read_accounts{&arena}; // read locks to release at commit/abort
+            flatmap::FlatMap<int> reserved{&arena}; // escrow withdrawals, account -> amount
+            flatmap::FlatMap<int> buffered_writes{&arena}; // OCC or deferred-update workspace, account -> delta
+            flatmap::FlatMap<mvcc::Version> snapshot_reads{&arena}; // validated at commit
+            bool has_snapshot = false;
+            mvcc::Version snapshot = 0;
 
-        bool check(){
-            for (auto &acc_bal_pair: this->account_balance){
-                if (acc_bal_pair.second.check_negative())
-                    return false;
+            // ready for the next transaction, without touching the heap
+            void reset(){
+                this->account_amounts.release();
+                this->read_accounts.release();
+                this->reserved.release();
+                this->buffered_writes.release();
+                this->snapshot_reads.release();
+                this->has_snapshot = false;
+                this->snapshot = 0;
+                this->arena.reset();
             }
-            return true;
+        };
+
+        /*
+         * Handler threads of all clients run transactions at once, so the tables are split into shards by id, each
+         * behind its own latch. A latch is only held for one table operation, never across a lock wait or while
+         * holding another shard's, so transactions spanning shards are ordered by the lock table alone.
+         * Balance and TransactionState stay put when a table grows, so they are used after the latch is released:
+         * a Balance is guarded by the account's lock, a TransactionState is only touched by its client's handler.
+         */
+        struct Shard{
+            mutex latch;
+            // keyed by interned account and client ids
+            flatmap::FlatMap<unique_ptr<Balance>> account_balance;
+            flatmap::FlatMap<unique_ptr<TransactionState>> client_transactions;
+            vector<unique_ptr<TransactionState>> idle_transactions; // finished states kept with their arenas for reuse
+        };
+        static const size_t NUM_SHARDS = 64;
+        static const size_t IDLE_PER_SHARD = 4; // at most 256 finished states are kept over all shards
+        array<Shard, NUM_SHARDS> shards;
+
+        atomic<int> num_accounts{0};
+        mvcc::VersionStore committed; // committed balances, read by BALANCE without locks
+        bool optimistic = false; // OCC: writes are buffered and only locked at the commit vote
+        bool escrow = false; // 2PL with shared increment locks for deposits and covered withdrawals
+        bool deferred = false; // 2PL whose writes stay in the transaction's workspace until commit
+        set<locktable::Key> split_accounts; // hot accounts striped over per-core counters from the start
+        atomic<int> negative_accounts{0}; // accounts whose working balance is below zero, for diagnostics
+
+        // keep negative_accounts up to date after the working balance of account changed
+        void track_negative(Balance* account){
+            this->negative_accounts += account->negative_change();
         }
 
-        void update_account_list(){
-            account_permanent.clear();
-            for(auto& acc_bal: this->account_balance){
-                this->account_permanent.push_back(acc_bal.first);
+        // the low bits of an interned id are a hash of its name (the interner's stripe), so ids spread evenly
+        // over the shards whatever order accounts are created in. The lock table, the version store and the
+        // balance stripes index by the same bits, so an account sits at the same index in each; that is
+        // intended: two accounts share an index with the same 1/64 chance in each structure as with independent
+        // hashes, and every structure has latches of its own, so sharing an index never couples two of them
+        Shard& shard_of(uint32_t id){
+            return this->shards[id % NUM_SHARDS];
+        }
+
+        Balance* find_account(locktable::Key account_key){
+            Shard& shard = this->shard_of(account_key);
+            lock_guard<mutex> latch(shard.latch);
+            unique_ptr<Balance>* account = shard.account_balance.find(account_key);
+            return account==nullptr ? nullptr : account->get();
+        }
+
+        TransactionState* find_transaction(locktable::Owner txn){
+            Shard& shard = this->shard_of(txn);
+            lock_guard<mutex> latch(shard.latch);
+            unique_ptr<TransactionState>* txn_state = shard.client_transactions.find(txn);
+            return txn_state==nullptr ? nullptr : txn_state->get();
+        }
+
+        TransactionState& transaction(locktable::Owner txn){
+            Shard& shard = this->shard_of(txn);
+            lock_guard<mutex> latch(shard.latch);
+            unique_ptr<TransactionState>& txn_state = shard.client_transactions[txn];
+            if(!txn_state){
+                if(shard.idle_transactions.empty()){
+                    txn_state.reset(new TransactionState());
+                }
+                else{
+                    txn_state = move(shard.idle_transactions.back());
+                    shard.idle_transactions.pop_back();
+                }
             }
+            return *txn_state;
         }
 
-        bool deposit(string server_account, int deposit_amount, string client_id){
-            // current transaction records
-            if(!(this->client_transaction__account_amounts.count(client_id)>0)){
-                pair<string,int> account_amounts_pair(server_account,deposit_amount);
-                pair<string, map<string,int>> client_transaction__account__pair;
-                client_transaction__account__pair.first = client_id;
-                client_transaction__account__pair.second.insert(account_amounts_pair);
-                this->client_transaction__account_amounts.insert(client_transaction__account__pair);
+        // the caller holds the write lock of account_key
+        void create_account(locktable::Key account_key, int amount){
+            Balance* account = new Balance(amount, account_key);
+            if(this->split_accounts.count(account_key)>0){
+                account->split();
             }
-            else{
-                if(!(this->client_transaction__account_amounts[client_id].count(server_account)>0)){
-                    pair<string,int> account_amounts_pair(server_account,deposit_amount);
-                    this->client_transaction__account_amounts[client_id].insert(account_amounts_pair);
+            this->track_negative(account);
+            {
+                Shard& shard = this->shard_of(account_key);
+                lock_guard<mutex> latch(shard.latch);
+                shard.account_balance.emplace(account_key, unique_ptr<Balance>(account));
+            }
+            this->num_accounts++;
+        }
+
+        // the caller holds the write lock of account_key
+        void erase_account(locktable::Key account_key){
+            unique_ptr<Balance> account;
+            {
+                Shard& shard = this->shard_of(account_key);
+                lock_guard<mutex> latch(shard.latch);
+                unique_ptr<Balance>* found = shard.account_balance.find(account_key);
+                if(found==nullptr){
+                    return;
+                }
+                account = move(*found);
+                shard.account_balance.erase(account_key);
+            }
+            this->num_accounts--;
+        }
+
+        bool holds_lock(locktable::Owner txn, locktable::Key account_key){
+            TransactionState* txn_state = this->find_transaction(txn);
+            return txn_state!=nullptr && (txn_state->account_amounts.contains(account_key) ||
+                                          txn_state->read_accounts.contains(account_key));
+        }
+
+        bool snapshot_read(locktable::Key account_key, locktable::Owner txn, int& bal, mvcc::Version& version){
+            TransactionState& txn_state = this->transaction(txn);
+            if(!txn_state.has_snapshot){
+                txn_state.snapshot = committed.open_snapshot();
+                txn_state.has_snapshot = true;
+            }
+            return committed.read(account_key, txn_state.snapshot, bal, version);
+        }
+
+        // apply a transaction's workspace to the accounts, which it has write locked
+        void install_buffered_writes(TransactionState& txn_state){
+            for(auto account_delta: txn_state.buffered_writes){
+                Balance* account = this->find_account(account_delta.key);
+                if(account!=nullptr){
+                    account->increase(account_delta.value);
+                    this->track_negative(account);
                 }
                 else{
-                    this->client_transaction__account_amounts[client_id][server_account] += deposit_amount;
+                    this->create_account(account_delta.key, account_delta.value);
                 }
+                txn_state.account_amounts[account_delta.key] = account_delta.value;
             }
+        }
 
-            if(this->account_balance.count(server_account)>0 && deposit_amount>0){
-                this->account_balance.at(server_account).increase(deposit_amount,client_id);
+        bool buffered_write(locktable::Key account_key, locktable::Owner txn, int& delta){
+            TransactionState* txn_state = this->find_transaction(txn);
+            int* buffered = txn_state==nullptr ? nullptr : txn_state->buffered_writes.find(account_key);
+            if(buffered==nullptr){
+                return false;
             }
-            else{ // an account is automatically created if it does not exist.
-                // insert
-                this->account_balance.emplace(server_account, Balance(deposit_amount,this->num_accounts++));
+            delta = *buffered;
+            return true;
+        }
+    public:
+        Transactions() = default;
+
+        // choose OCC over 2PL, before any transaction runs
+        void set_optimistic(bool optimistic_){
+            this->optimistic = optimistic_;
+        }
+
+        // accounts to stripe over per-core counters, before any transaction runs
+        void split_account(const string& server_account){
+            this->split_accounts.insert(account_ids.intern(server_account));
+        }
+
+        // choose escrow locking for 2PL, before any transaction runs
+        void set_escrow(bool escrow_){
+            this->escrow = escrow_;
+        }
+
+        // choose deferred updates for 2PL, before any transaction runs: accounts are write locked as before, but
+        // only changed at commit, so an abort just drops the workspace
+        void set_deferred(bool deferred_){
+            this->deferred = deferred_;
+        }
+
+        // commit vote: none of the accounts this transaction wrote is overdrawn. Accounts it did not write are
+        // not its business, another transaction's tentative overdraft is caught by that transaction's own vote
+        bool check(locktable::Owner txn){
+            TransactionState* txn_state = this->find_transaction(txn);
+            if(txn_state==nullptr){
+                return true;
+            }
+            for (auto acc_amt: txn_state->account_amounts){
+                Balance* account = this->find_account(acc_amt.key);
+                if (account!=nullptr && account->check_negative())
+                    return false;
+            }
+            if (this->deferred){
+                for (auto account_delta: txn_state->buffered_writes){
+                    Balance* account = this->find_account(account_delta.key);
+                    if ((account==nullptr ? 0 : account->getAmount()) + account_delta.value < 0)
+                        return false;
+                }
             }
             return true;
         }
 
-        void print_balance() {
-            for (auto &acc_bal_pair: this->account_balance) {
-                /*
-                 * Every time a server commits any updates to its objects, it should print the balance of all accounts with non-zero values.
-                 */
-                if (acc_bal_pair.second.check_positive()) {
-                    cout << acc_bal_pair.first << " = " << acc_bal_pair.second.getAmount() << endl;
+        int negative_account_count() const {
+            return this->negative_accounts.load();
+        }
 
+        bool deposit(locktable::Key account_key, int deposit_amount, locktable::Owner txn, rwlock::CancellationToken* cancel_token = nullptr){
+            if(this->optimistic){
+                this->transaction(txn).buffered_writes[account_key] += deposit_amount;
+                return true;
+            }
+            if(this->deferred){
+                // the account is created at commit if it does not exist by then
+                if(!lock_table.write_lock(account_key, txn, cancel_token)){
+                    return false;
+                }
+                this->transaction(txn).buffered_writes[account_key] += deposit_amount;
+                return true;
+            }
+            // lock the id before looking the account up, an account created by a transaction that aborts
+            // while this one waits is gone when the lock is granted
+            if(!(this->escrow ? lock_table.increment_lock(account_key, txn, cancel_token)
+                              : lock_table.write_lock(account_key, txn, cancel_token))){
+                return false; // aborted while waiting, nothing to record
+            }
+            // current transaction records, from here on the lock is released by commit/abort
+            int& account_amount = this->transaction(txn).account_amounts[account_key];
+            Balance* account = this->find_account(account_key);
+            if(account!=nullptr){
+                if(this->escrow && deposit_amount<0 && !lock_table.write_lock(account_key, txn, cancel_token)){
+                    return false; // a negative deposit is a withdrawal nobody reserved
                 }
+                account->increase(deposit_amount);
+                this->track_negative(account);
             }
+            else{ // an account is automatically created if it does not exist.
+                if(this->escrow && !lock_table.write_lock(account_key, txn, cancel_token)){
+                    return false; // creating it does not commute with other deposits
+                }
+                // insert
+                this->create_account(account_key, deposit_amount);
+            }
+            account_amount += deposit_amount;
+            return true;
         }
 
-        bool getBalanceAmount(string server_account, string client_id, int& bal){
-            if(this->account_balance.count(server_account)>0){
-                bal = this->account_balance[server_account].getAmount(client_id);
+        bool getBalanceAmount(locktable::Key account_key, locktable::Owner txn, int& bal, rwlock::CancellationToken* cancel_token = nullptr){
+            int delta = 0;
+            if(this->deferred && this->buffered_write(account_key, txn, delta)){
+                // the write lock keeps the account as committed, the workspace holds this transaction's changes
+                Balance* account = this->find_account(account_key);
+                bal = (account==nullptr ? 0 : account->getAmount()) + delta;
                 DEBUG_INFO(to_string(bal));
                 return true;
             }
-            else{
+            if(this->optimistic || !this->holds_lock(txn, account_key)){
+                // read from the transaction's snapshot of committed balances, never waits for a writer;
+                // commit checks that nobody committed to the account since
+                mvcc::Version version = 0;
+                bool found = this->snapshot_read(account_key, txn, bal, version);
+                bool buffered = this->buffered_write(account_key, txn, delta);
+                if(!found && !buffered){
+                    return false;
+                }
+                if(!found){
+                    bal = 0; // created by this transaction, the commit vote checks that nobody else created it
+                }
+                bal += delta;
+                this->transaction(txn).snapshot_reads.emplace(account_key, version);
+                DEBUG_INFO(to_string(bal));
+                return true;
+            }
+            // its own writes are not committed yet, read them under the lock it already holds
+            if(this->find_account(account_key)==nullptr){
+                return false;
+            }
+            if(!lock_table.read_lock(account_key, txn, cancel_token)){
+                return false;
+            }
+            Balance* account = this->find_account(account_key);
+            if(account==nullptr){
+                lock_table.release(account_key, txn); // its creator aborted while this transaction waited
                 return false;
             }
+            bal = account->getAmount();
+            this->transaction(txn).read_accounts[account_key] = true;
+            DEBUG_INFO(to_string(bal));
+            return true;
         }
 
-        bool withdraw(string server_account, int withdraw_amount, string client_id){
-            // current transaction records
-            if(!(this->client_transaction__account_amounts.count(client_id)>0)){
-                pair<string,int> account_amounts_pair(server_account,-withdraw_amount);
-                pair<string, map<string,int>> client_transaction__account__pair;
-                client_transaction__account__pair.first = client_id;
-                client_transaction__account__pair.second.insert(account_amounts_pair);
-                this->client_transaction__account_amounts.insert(client_transaction__account__pair);
+        bool withdraw(locktable::Key account_key, int withdraw_amount, locktable::Owner txn, rwlock::CancellationToken* cancel_token = nullptr){
+            if(this->optimistic){
+                int bal, delta;
+                mvcc::Version version;
+                if(!this->buffered_write(account_key, txn, delta) &&
+                   !this->snapshot_read(account_key, txn, bal, version)){
+                    return false; // committed accounts are never removed, so it cannot appear before commit
+                }
+                this->transaction(txn).buffered_writes[account_key] -= withdraw_amount;
+                return true;
+            }
+            if(this->deferred){
+                int delta;
+                bool created = this->buffered_write(account_key, txn, delta); // by this transaction, not committed yet
+                if(!created && this->find_account(account_key)==nullptr){
+                    return false;
+                }
+                if(!lock_table.write_lock(account_key, txn, cancel_token)){
+                    return false;
+                }
+                this->transaction(txn).buffered_writes[account_key] -= withdraw_amount;
+                return true;
+            }
+            if(this->find_account(account_key)==nullptr){
+                return false; // reply to the client
+            }
+            if(!(this->escrow ? lock_table.increment_lock(account_key, txn, cancel_token)
+                              : lock_table.write_lock(account_key, txn, cancel_token))){
+                return false; // aborted while waiting, nothing to record
+            }
+            Balance* account = this->find_account(account_key);
+            if(account==nullptr){
+                lock_table.release(account_key, txn); // its creator aborted while this transaction waited
+                return false;
+            }
+            // current transaction records, from here on the lock is released by commit/abort
+            TransactionState& txn_state = this->transaction(txn);
+            int& account_amount = txn_state.account_amounts[account_key];
+            // The account balance should decrease by the withdrawn amount.
+            if(this->escrow && account->reserve(withdraw_amount)){
+                txn_state.reserved[account_key] += withdraw_amount;
             }
             else{
-                if(!(this->client_transaction__account_amounts[client_id].count(server_account)>0)){
-                    pair<string,int> account_amounts_pair(server_account,-withdraw_amount);
-                    this->client_transaction__account_amounts[client_id].insert(account_amounts_pair);
+                // not covered by the committed balance, wait until this transaction has the account to itself
+                if(this->escrow && !lock_table.write_lock(account_key, txn, cancel_token)){
+                    return false;
                 }
-                else{
-                    this->client_transaction__account_amounts[client_id][server_account] -= withdraw_amount;
+                account->decrease(withdraw_amount);
+            }
+            this->track_negative(account);
+            account_amount -= withdraw_amount;
+            return true;
+        }
 
-                }
+        // the transaction has not written anything on this server
+        bool read_only(locktable::Owner txn){
+            TransactionState* txn_state = this->find_transaction(txn);
+            return txn_state==nullptr || (txn_state->account_amounts.empty() && txn_state->buffered_writes.empty());
+        }
+
+        // commit vote: lock the accounts read from the snapshot and, under OCC, the ones written, in id order;
+        // check that no read went stale and install the buffered writes as if they had been made under 2PL.
+        // false if a read went stale or the transaction was cancelled while waiting
+        bool prepare(locktable::Owner txn, rwlock::CancellationToken* cancel_token = nullptr){
+            TransactionState* txn_state = this->find_transaction(txn);
+            if(txn_state==nullptr){
+                return true;
             }
+            flatmap::FlatMap<mvcc::Version>& reads = txn_state->snapshot_reads;
+            flatmap::FlatMap<int>& writes = txn_state->buffered_writes;
+            vector<locktable::Key> accounts;
+            for(auto account_version: reads) accounts.push_back(account_version.key);
+            for(auto account_delta: writes){
+                // deferred updates locked what they write already
+                if(!this->deferred && !reads.contains(account_delta.key)) accounts.push_back(account_delta.key);
+            }
+            sort(accounts.begin(), accounts.end());
 
-            if(this->account_balance.count(server_account)>0) {
-                // The account balance should decrease by the withdrawn amount.
-                this->account_balance[server_account].decrease(withdraw_amount,client_id);
+            for(locktable::Key account_key: accounts){
+                if(!this->deferred && writes.contains(account_key)){
+                    if(!lock_table.write_lock(account_key, txn, cancel_token)){
+                        return false;
+                    }
+                    txn_state->account_amounts.emplace(account_key, 0); // released and rolled back by abort
+                }
+                else{
+                    if(!lock_table.read_lock(account_key, txn, cancel_token)){
+                        return false;
+                    }
+                    txn_state->read_accounts[account_key] = true;
+                }
+                mvcc::Version* read_version = reads.find(account_key);
+                if(read_version!=nullptr && committed.latest(account_key)!=*read_version){
+                    return false;
+                }
             }
-            else{
-                // reply to the client
-                return false;
+
+            if(!this->deferred){
+                this->install_buffered_writes(*txn_state); // deferred updates wait for the commit
             }
             return true;
         }
 
-        void commit(string client_id){
-            // 2 phase lock requires to release lock related to the transaction (client_id) at this point
+        // 2 phase lock requires to release lock related to the transaction (txn) at this point
+        void release_transaction_locks(locktable::Owner txn){
+            TransactionState* txn_state = this->find_transaction(txn);
+            if(txn_state!=nullptr){
+                for(auto acc_amt: txn_state->account_amounts){
+                    lock_table.release(acc_amt.key, txn);
+                }
+                for(auto account: txn_state->read_accounts){
+                    lock_table.release(account.key, txn);
+                }
+                if(this->deferred){
+                    for(auto account_delta: txn_state->buffered_writes){ // not installed if it aborts
+                        lock_table.release(account_delta.key, txn);
+                    }
+                }
+                if(txn_state->has_snapshot){
+                    committed.close_snapshot(txn_state->snapshot);
+                }
+                Shard& shard = this->shard_of(txn);
+                unique_ptr<TransactionState> finished;
+                {
+                    lock_guard<mutex> latch(shard.latch);
+                    finished = move(*shard.client_transactions.find(txn));
+                    shard.client_transactions.erase(txn); // this transaction of the client is finished
+                }
+                finished->reset(); // outside the latch, it is nobody else's
+                lock_guard<mutex> latch(shard.latch);
+                if(shard.idle_transactions.size()<IDLE_PER_SHARD){
+                    shard.idle_transactions.push_back(move(finished));
+                }
+            }
+            lock_table.end_transaction(txn);
+        }
+
+        void commit(locktable::Owner txn){
             // release the lock and proceed
-            if(this->client_transaction__account_amounts.count(client_id)>0){
-                this->update_account_list();
-                for(auto acc_amt_pair:this->client_transaction__account_amounts[client_id]){
-                    auto &bal = this->account_balance[acc_amt_pair.first];
-                    bal.release_locks();
+            TransactionState* txn_state = this->find_transaction(txn);
+            if(txn_state!=nullptr && this->deferred){
+                this->install_buffered_writes(*txn_state);
+            }
+            if(txn_state!=nullptr && !txn_state->account_amounts.empty()){
+                // publish the changes to snapshot readers while the locks are still held; the store adds them up
+                // itself, escrow holders of one account commit concurrently and may get here in any order
+                balancereport::Deltas deltas;
+                for(auto acc_amt: txn_state->account_amounts){
+                    int* reserved = txn_state->reserved.find(acc_amt.key);
+                    this->find_account(acc_amt.key)->commit(acc_amt.value, reserved==nullptr ? 0 : *reserved);
+                    deltas.emplace_back(acc_amt.key, acc_amt.value);
                 }
-                this->client_transaction__account_amounts.erase(client_id); // this transaction of client_id is finished
+                committed.commit(deltas);
+                /*
+                 * Every time a server commits any updates to its objects, it should print the balance of all accounts with non-zero values.
+                 */
+                balance_reporter.publish(move(deltas));
             }
+            this->release_transaction_locks(txn);
         }
 
-        void abort(string client_id){
+        void abort(locktable::Owner txn){
             // All updates made during the transaction must be rolled back.
-            if(this->client_transaction__account_amounts.count(client_id)>0){
-                for(auto acc_amt_pair:this->client_transaction__account_amounts[client_id]){
-                    if(!(count(this->account_permanent.begin(), this->account_permanent.end(), acc_amt_pair.first)>0)){
-                        this->account_balance.erase(acc_amt_pair.first);
+            // Deferred updates only ever reach the accounts at commit, so there is nothing to undo
+            TransactionState* txn_state = this->find_transaction(txn);
+            if(txn_state!=nullptr){
+                for(auto acc_amt: txn_state->account_amounts){
+                    Balance* account = this->find_account(acc_amt.key);
+                    if(account==nullptr){
+                        continue;
+                    }
+                    if(!account->is_committed()){
+                        if(account->counted_as_negative()) this->negative_accounts--;
+                        this->erase_account(acc_amt.key); // created by this transaction
                     }
                     else{
-                        this->account_balance[acc_amt_pair.first].roll_back(acc_amt_pair.second,client_id);
+                        int* reserved = txn_state->reserved.find(acc_amt.key);
+                        account->roll_back(acc_amt.value, reserved==nullptr ? 0 : *reserved);
+                        this->track_negative(account);
                     }
                 }
             }
             else{
                 DEBUG_INFO("Nothing to roll back");
             }
-
-            // 2 phase lock requires to release lock related to the transaction (client_id) at this point
-            if(this->client_transaction__account_amounts.count(client_id)>0){
-                for(auto acc_amt_pair:this->client_transaction__account_amounts[client_id]){
-                    auto &bal = this->account_balance[acc_amt_pair.first];
-                    bal.release_locks();
-                }
-                this->client_transaction__account_amounts.erase(client_id); // this transaction of client_id is finished
-            }
-            else{
-                DEBUG_INFO("Nothing to roll back");
-            }
+            this->release_transaction_locks(txn);
         }
 };
 
@@ -262,138 +699,362 @@ message_base::MessageBaseServer server;
 string server_id;
 Transactions transactions;
 
-void server_client_rpc_handling_server(deque<json>* client_rpc_command_queue, mutex* client_rpc_queue_mtx){
-    while(true){
-        sleep(0.001);
-        if(!client_rpc_command_queue->empty()){
-            client_rpc_queue_mtx->lock();
-            json rpc = client_rpc_command_queue->front();
-            client_rpc_queue_mtx->unlock();
-
-            json rpl_rpc;
-            if(rpc["type"].get<string>()==message_base::DEPOSIT){
-                DEBUG_INFO(message_base::DEPOSIT+"!");
-                bool state = transactions.deposit(rpc["account"].get<string>(),rpc["amount"].get<int>(),rpc["clientID"].get<string>());
-                DEBUG_INFO(message_base::DEPOSIT+"!");
-                // always true
-                rpl_rpc = json{{"serverID", server_id},
-                               {"state", state},};
-                server.unicast(rpc["clientID"].get<string>(),rpl_rpc);
+// a request as it came off the wire, decoded by the handling thread
+struct RawRequest{
+    string payload; // a buffer of the buffer pool
+    message_base::WireCodec codec;
+};
+
+// per-connection state, RPCs are executed in order by the connection's handling thread
+struct ClientSession{
+    string client_id;
+    locktable::Owner client_key; // client_id interned once, the transaction's id in Transactions and the lock table
+    blockingqueue::BlockingQueue<RawRequest> client_rpc_command_queue;
+    arena::Arena rpc_arena; // the request being executed and its reply, rewound for the next one
+    rwlock::CancellationToken cancel_token; // cancelled by ABORT, reset once the ABORT itself is executed
+    uint64_t registered_ts = 0; // ts of the transaction last registered with the lock table
+    atomic<bool> closed{false}; // the client disconnected, only a commit decision it already sent is still run
+    // a reconnecting client's earlier session, whose handler still owns the transaction until it finishes
+    shared_ptr<ClientSession> previous;
+    blockingqueue::BlockingQueue<bool> handler_done; // closed once the handler rolled back and exits
+};
+
+// the newest session of every client id, a new one waits for the handler of the one it replaces
+mutex live_sessions_mx;
+flatmap::FlatMap<shared_ptr<ClientSession>> live_sessions;
+
+// queued by the lock table to a wound-wait victim's session, never sent over the wire
+const string WOUNDED = "WOUNDED";
+
+// answer to an RPC of a transaction that was aborted while it was queued or waiting for a lock
+rpc_json aborted_reply(){
+    return rpc_json{{"serverID", server_id},
+                {"state", false},
+                {"aborted", true}};
+}
+
+// the transaction was cancelled while this RPC waited for a lock (timeout, deadlock victim or ABORT): roll it
+// back right away so its other locks are freed before the client's ABORT arrives, which then has nothing to undo
+rpc_json abort_cancelled(locktable::Owner txn){
+    transactions.abort(txn);
+    return aborted_reply();
+}
+
+void server_client_rpc_handling_server(shared_ptr<ClientSession> session){
+    rwlock::CancellationToken* cancel_token = &session->cancel_token;
+    const string& client_id = session->client_id;
+    locktable::Owner txn = session->client_key;
+    arena::ArenaScope rpc_scope(session->rpc_arena); // rpc and rpl_rpc below live in it
+    if(session->previous){
+        // transaction state is kept per client id, so only one handler may run for it at a time
+        bool done;
+        session->previous->handler_done.pop(done); // returns once the old handler closed it
+        session->previous.reset();
+    }
+    RawRequest request;
+    while(session->client_rpc_command_queue.pop(request)){ // sleeps while the client is idle
+        session->rpc_arena.reset(); // the previous request and reply are gone
+        rpc_json rpc = request.codec==message_base::WireCodec::MSGPACK
+                       ? rpc_json::from_msgpack(request.payload.data(), request.payload.data()+request.payload.size())
+                       : rpc_json::parse(request.payload.data(), request.payload.data()+request.payload.size());
+        bufferpool::default_pool().release(move(request.payload));
+        if(session->closed.load() && !(rpc["type"].get<string>()==message_base::COMMIT && rpc["CP_NUM"].get<int>()==2)){
+            continue; // nobody waits for the reply, the transaction is aborted below unless its CP2 commits it
+        }
+
+        rpc_json rpl_rpc;
+        if(rpc.contains("ts") && rpc["ts"].get<uint64_t>()!=session->registered_ts){
+            // stamped by the client at BEGIN, orders conflicting transactions under wound-wait / wait-die. Only
+            // the first RPC of a transaction registers it; the ones after it carry the same ts
+            session->registered_ts = rpc["ts"].get<uint64_t>();
+            lock_table.begin_transaction(txn, locktable::Age(session->registered_ts, client_id), cancel_token);
+        }
+        if(rpc["type"].get<string>()==WOUNDED){
+            // an older transaction waits for this one's locks, roll back and release them now; the client learns
+            // of the abort at its next RPC. A transaction started since the wound has a fresh token and survives.
+            // A prepared transaction is never wounded, its fate is the coordinator's.
+            if(cancel_token->is_cancelled() && !lock_table.prepared(txn)){
+                transactions.abort(txn);
+            }
+        }
+        else if(rpc["type"].get<string>()==message_base::ABORT){
+            DEBUG_INFO(message_base::ABORT+"!");
+            // everything queued before the ABORT has been answered, so rollback and lock release happen here,
+            // on the thread that owns the transaction, never while one of its operations is still running
+            transactions.abort(txn);
+            cancel_token->reset();
+            rpl_rpc = rpc_json{{"serverID", server_id},
+                               {"state", true}};
+            server.unicast(client_id, rpl_rpc, request.codec);
+        }
+        else if(cancel_token->is_cancelled()){
+            if(rpc["type"].get<string>()==message_base::COMMIT && rpc["CP_NUM"].get<int>()==2 &&
+               rpc["CP_STATE"].get<bool>() && lock_table.prepared(txn)){
+                // voted yes before it was cancelled, the decision stands
+                transactions.commit(txn);
+                cancel_token->reset();
+            }
+            else if(rpc["type"].get<string>()==message_base::COMMIT && rpc["CP_NUM"].get<int>()==2){
+                // a victim whose client saw the abort during the commit vote, it ends the transaction this way
+                transactions.abort(txn);
+                cancel_token->reset();
+            }
+            else if(rpc["type"].get<string>()==message_base::COMMIT && rpc.value("read_only", false)){
+                // a single round commit is the last RPC of its transaction, nothing else will reset the token
+                transactions.abort(txn);
+                cancel_token->reset();
+                server.unicast(client_id, aborted_reply(), request.codec);
+            }
+            else{
+                // queued before the ABORT, answer without executing
+                server.unicast(client_id, aborted_reply(), request.codec);
             }
-            else if(rpc["type"].get<string>()==message_base::BALANCE){
-                DEBUG_INFO(message_base::BALANCE+"!");
-                int bal_am = 0;
-                if(transactions.getBalanceAmount(rpc["account"].get<string>(),rpc["clientID"].get<string>(),bal_am)){
-                    rpl_rpc = json{{"serverID", server_id},
+        }
+        else if(rpc["type"].get<string>()==message_base::DEPOSIT){
+            DEBUG_INFO(message_base::DEPOSIT+"!");
+            bool state = transactions.deposit(account_ids.intern(rpc["account"].get_ref<const string&>()),rpc["amount"].get<int>(),txn,cancel_token);
+            DEBUG_INFO(message_base::DEPOSIT+"!");
+            // always true unless aborted while waiting for the lock
+            rpl_rpc = rpc_json{{"serverID", server_id},
+                               {"state", state},};
+            if(cancel_token->is_cancelled()) rpl_rpc = abort_cancelled(txn);
+            server.unicast(client_id, rpl_rpc, request.codec);
+        }
+        else if(rpc["type"].get<string>()==message_base::BALANCE){
+            DEBUG_INFO(message_base::BALANCE+"!");
+            int bal_am = 0;
+            if(transactions.getBalanceAmount(account_ids.intern(rpc["account"].get_ref<const string&>()),txn,bal_am,cancel_token)){
+                rpl_rpc = rpc_json{{"serverID", server_id},
                                    {"state", true},
                                    {"balance", bal_am},};
-                }
-                else{
-                    rpl_rpc = json{{"serverID", server_id},
+            }
+            else{
+                rpl_rpc = rpc_json{{"serverID", server_id},
                                    {"state", false},
                                    {"balance", bal_am},};
-                }
-                DEBUG_INFO(message_base::BALANCE+"!");
-                server.unicast(rpc["clientID"].get<string>(), rpl_rpc);
             }
-            else if(rpc["type"].get<string>()==message_base::WITHDRAW){
-                DEBUG_INFO(message_base::WITHDRAW+"!");
-                if(transactions.withdraw(rpc["account"].get<string>(),rpc["amount"].get<int>(),rpc["clientID"].get<string>())){
-                    rpl_rpc = json{{"serverID", server_id},
+            DEBUG_INFO(message_base::BALANCE+"!");
+            if(cancel_token->is_cancelled()) rpl_rpc = abort_cancelled(txn);
+            server.unicast(client_id, rpl_rpc, request.codec);
+        }
+        else if(rpc["type"].get<string>()==message_base::WITHDRAW){
+            DEBUG_INFO(message_base::WITHDRAW+"!");
+            if(transactions.withdraw(account_ids.intern(rpc["account"].get_ref<const string&>()),rpc["amount"].get<int>(),txn,cancel_token)){
+                rpl_rpc = rpc_json{{"serverID", server_id},
                                    {"state", true}};
-                }else{
-                    rpl_rpc = json{{"serverID", server_id},
+            }else{
+                rpl_rpc = rpc_json{{"serverID", server_id},
                                    {"state", false}};
-                }
-                DEBUG_INFO(message_base::WITHDRAW+"!");
-                server.unicast(rpc["clientID"].get<string>(), rpl_rpc);
             }
-            else if (rpc["type"].get<string>()==message_base::COMMIT){
+            DEBUG_INFO(message_base::WITHDRAW+"!");
+            if(cancel_token->is_cancelled()) rpl_rpc = abort_cancelled(txn);
+            server.unicast(client_id, rpl_rpc, request.codec);
+        }
+        else if (rpc["type"].get<string>()==message_base::COMMIT){
+            DEBUG_INFO(message_base::COMMIT+"!");
+            // 2PC
+            if(rpc["CP_NUM"].get<int>()==1){
+                // nothing written here: validating the reads is the whole commit, so it ends in this round
+                bool read_only = transactions.read_only(txn);
+                bool state = transactions.prepare(txn, cancel_token) &&
+                             (read_only || transactions.check(txn));
+                if(state && !read_only){
+                    // wound-wait must not take the transaction away once it voted yes
+                    state = lock_table.prepare_transaction(txn);
+                }
                 DEBUG_INFO(message_base::COMMIT+"!");
-                // 2PC
-                if(rpc["CP_NUM"].get<int>()==1){
-                    bool state = transactions.check();
-                    DEBUG_INFO(message_base::COMMIT+"!");
-                    rpl_rpc = json{{"serverID", server_id},
+                rpl_rpc = rpc_json{{"serverID", server_id},
                                    {"state", state}};
-                    server.unicast(rpc["clientID"].get<string>(), rpl_rpc);
+                if(cancel_token->is_cancelled()){
+                    rpl_rpc = abort_cancelled(txn);
+                    if(rpc.value("read_only", false)) cancel_token->reset(); // no second round will come
                 }
-                else if(rpc["CP_NUM"].get<int>()==2){
-                    if(rpc["CP_STATE"].get<bool>()){
-                        transactions.commit(rpc["clientID"].get<string>());
+                else if(read_only){
+                    if(state){
+                        transactions.commit(txn); // releases the read locks and the snapshot now
                     }else{
-                        transactions.abort(rpc["clientID"].get<string>());
+                        transactions.abort(txn);
                     }
-                    DEBUG_INFO(message_base::COMMIT+"!");
-                    // no_rpl
-                    transactions.print_balance();
+                    rpl_rpc["read_only"] = true; // leave this server out of the second round
                 }
+                server.unicast(client_id, rpl_rpc, request.codec);
             }
+            else if(rpc["CP_NUM"].get<int>()==2){
+                if(rpc["CP_STATE"].get<bool>()){
+                    transactions.commit(txn);
+                }else{
+                    transactions.abort(txn);
+                }
+                DEBUG_INFO(message_base::COMMIT+"!");
+                // no_rpl, the committed balances are printed by balance_reporter
+            }
+        }
 
-            client_rpc_queue_mtx->lock();
-            client_rpc_command_queue->pop_front();
-            client_rpc_queue_mtx->unlock();
+    }
+    // the connection is closed, roll back whatever the client left open
+    transactions.abort(txn);
+    {
+        lock_guard<mutex> lock(live_sessions_mx);
+        shared_ptr<ClientSession>* live = live_sessions.find(txn);
+        if(live!=nullptr && *live==session){
+            live_sessions.erase(txn);
         }
     }
+    session->handler_done.close();
 }
-void server_recv_worker(message_base::NodeConnection* nc){
-    int numbytes;
-    char buffer[message_base::BUFFER_SIZE];
-    deque<json> client_rpc_command_queue;
-    mutex client_rpc_queue_mtx;
-    // Dynamic Parallism
-    thread client_rpc_handling_thread(server_client_rpc_handling_server, &client_rpc_command_queue,&client_rpc_queue_mtx);
-    auto client_rpc_handling_thread_handle = client_rpc_handling_thread.native_handle();
-    client_rpc_handling_thread.detach();
-
-    while((numbytes = ::recv(nc->send_recv_socket_fd, buffer, message_base::BUFFER_SIZE, 0))>0)
-    {
-        buffer[numbytes] = '\0';
-        string j_str = buffer;
-        json rpc = json::parse(j_str);
-        string client_id = rpc["clientID"].get<string>();
 
-        if (nc->node_identifier == "node"){ // not initialized its identifier
-            nc->node_identifier = client_id;
+// requests of the deadlock detector, answered on the I/O thread
+void server_on_detector_message(message_base::NodeConnection* nc, json& rpc, message_base::WireCodec codec){
+    if(rpc["type"].get<string>()==message_base::WAITS_FOR){
+        json edges = json::array();
+        for(auto& edge: lock_table.wait_for_edges()){
+            edges.push_back(json::array({client_ids.name(edge.first), client_ids.name(edge.second)}));
         }
+        nc->send_json(json{{"serverID", server_id},
+                           {"edges", edges}}, codec);
+    }
+    else if(rpc["type"].get<string>()==message_base::VICTIM){
+        // wake the victim if it waits for a lock here, its client then aborts the transaction everywhere;
+        // a victim that is not blocked here any more is left alone, its wait-for edges were stale
+        auto victim_nc = server.connections.find(rpc["victim"].get<string>());
+        if(victim_nc && victim_nc->context){
+            if(static_pointer_cast<ClientSession>(victim_nc->context)->cancel_token.cancel_if_waiting()){
+                DEBUG_INFO("Deadlock victim "+rpc["victim"].get<string>());
+            }
+        }
+    }
+    else if(rpc["type"].get<string>()==message_base::LOCK_STATS){
+        json timeouts = json::object();
+        for(auto& key_count: lock_table.timeout_counts()){
+            timeouts[account_ids.name(key_count.first)] = key_count.second;
+        }
+        nc->send_json(json{{"serverID", server_id},
+                           {"timeouts", timeouts},
+                           {"negative_accounts", transactions.negative_account_count()}}, codec);
+    }
+}
 
-        json rpl_rpc;
-        // tell if this is ABORT
-        if (rpc["type"].get<string>()==message_base::ABORT){
-            DEBUG_INFO(message_base::ABORT+"!");
-            rpl_rpc = json{{"serverID", server_id},
-                           {"state", true}};
-            transactions.abort(rpc["clientID"].get<string>());
-            client_rpc_queue_mtx.unlock();
-            pthread_cancel(client_rpc_handling_thread_handle); // cancel the current thread
-            server.unicast(rpc["clientID"].get<string>(), rpl_rpc);
-
-            // clear the queue of previous transaction
-            client_rpc_queue_mtx.lock();
-            client_rpc_command_queue.clear();
-            client_rpc_queue_mtx.unlock();
-
-            client_rpc_handling_thread = thread(server_client_rpc_handling_server, &client_rpc_command_queue,&client_rpc_queue_mtx);
-            client_rpc_handling_thread_handle = client_rpc_handling_thread.native_handle();
-            client_rpc_handling_thread.detach(); // detach again
-            DEBUG_INFO("Relaunch thread successful!");
-        }
-        else{// if not ABORT, then put in queue
-            client_rpc_queue_mtx.lock();
-            client_rpc_command_queue.push_back(rpc);
-            client_rpc_queue_mtx.unlock();
+// called on an I/O thread for every message received, must not block. A client's requests are decoded by its
+// handling thread, here only the first message of a connection and the detector's are; an ABORT is known by
+// its frame header
+void server_on_frame(message_base::NodeConnection* nc, string&& payload, message_base::WireCodec codec, bool is_abort){
+    if (!nc->context){
+        json rpc = message_base::decode_message(payload.data(), payload.size(), codec);
+        string client_id = rpc["clientID"].get<string>();
+        if (client_id == message_base::DETECTOR_ID){
+            bufferpool::default_pool().release(move(payload));
+            server_on_detector_message(nc, rpc, codec);
+            return;
+        }
+        // Dynamic Parallism
+        auto new_session = make_shared<ClientSession>();
+        new_session->client_id = client_id;
+        new_session->client_key = client_ids.intern(client_id);
+        {
+            // a client that reconnects before its old handler finished gets a session that waits for it
+            lock_guard<mutex> lock(live_sessions_mx);
+            shared_ptr<ClientSession>& live = live_sessions[new_session->client_key];
+            new_session->previous = live;
+            live = new_session;
         }
+        // the thread shares ownership so the session outlives a closed and recycled connection slot
+        thread(server_client_rpc_handling_server, new_session).detach();
+        nc->context = new_session;
+        // not initialized its identifier, published once the session exists
+        server.bind_node_identifier(nc, client_id);
+    }
+    auto session = static_pointer_cast<ClientSession>(nc->context);
+
+    if (is_abort){
+        // wake the handling thread if it waits for a lock, it then answers what is queued and executes the ABORT
+        session->cancel_token.cancel();
+    }
+    session->client_rpc_command_queue.push(RawRequest{move(payload), codec});
+}
+
+// the client went away: stop its transaction, the handling thread rolls it back and exits
+void server_on_close(message_base::NodeConnection* nc){
+    if (nc->context){
+        auto session = static_pointer_cast<ClientSession>(nc->context);
+        // the client sends the commit decision and exits, so a CP2 may still be queued: let the handler drain the
+        // queue, skipping everything else, and abort what is left open afterwards. Only a lock wait in progress
+        // is cut short, a transaction that waits for a lock has not voted and cannot have been decided.
+        session->closed.store(true);
+        session->client_rpc_command_queue.close();
+        session->cancel_token.cancel_if_waiting();
     }
-    //::close(nc->send_recv_socket_fd);
 }
 
 // server
 int main(int argc, char const *argv[]) {
     string config_file;
     vector<message_base::ServerInfo> sinfo;
-    if(argc==3){
+    if(argc>=3 && argc<=5){
         server_id = argv[1];
         config_file = argv[2];
+        if(argc>=5){
+            // optional deadline of a lock wait in milliseconds, the waiting transaction is aborted; 0 waits forever
+            lock_table.set_wait_timeout(chrono::milliseconds(stoi(argv[4])));
+        }
+        if(argc>=4){
+            // optional comma separated concurrency control options:
+            // occ (optimistic instead of 2PL, locks are only taken by the commit vote),
+            // escrow (2PL where deposits and covered withdrawals share the account),
+            // deferred (2PL where writes go to a private workspace that is installed at commit and dropped at abort),
+            // split:<account> (keep that account in per-core counters) or split (do it for contended accounts),
+            // the deadlock handling: detect (default, needs ./detector), wound-wait or wait-die,
+            // and the balance reports: report:<ms> (at most one per interval) or report-binary:<file>
+            bool optimistic = false, deferred = false;
+            for(auto& option: parse(argv[3], ',')){
+                locktable::DeadlockPolicy policy;
+                if(option=="occ"){
+                    transactions.set_optimistic(true);
+                    optimistic = true;
+                }
+                else if(option=="escrow"){
+                    transactions.set_escrow(true);
+                }
+                else if(option=="deferred"){
+                    transactions.set_deferred(true);
+                    deferred = true;
+                }
+                else if(option=="split"){
+                    Balance::split_after_contention = 64;
+                }
+                else if(option.compare(0, 6, "split:")==0){
+                    transactions.split_account(option.substr(6));
+                }
+                else if(option.compare(0, 7, "report:")==0){
+                    balance_reporter.set_interval(chrono::milliseconds(stoi(option.substr(7))));
+                }
+                else if(option.compare(0, 14, "report-binary:")==0){
+                    if(!balance_reporter.set_binary(option.substr(14))){
+                        cout << "cannot open balance report file " << option.substr(14) << endl;
+                        return 0;
+                    }
+                }
+                else if(locktable::parse_deadlock_policy(option, policy)){
+                    lock_table.set_policy(policy);
+                }
+                else{
+                    cout << "unknown concurrency control option " << option << endl;
+                    return 0;
+                }
+            }
+            if(optimistic && deferred){
+                // deferred updates are a 2PL variant, under OCC they would install writes no vote locked
+                cout << "occ and deferred cannot be combined" << endl;
+                return 0;
+            }
+            lock_table.set_wound_handler([](locktable::Owner owner){
+                auto nc = server.connections.find(client_ids.name(owner));
+                if(nc && nc->context){
+                    static_pointer_cast<ClientSession>(nc->context)->client_rpc_command_queue.push(RawRequest{
+                        json{{"clientID", client_ids.name(owner)}, {"type", WOUNDED}}.dump(),
+                        message_base::WireCodec::JSON_TEXT});
+                }
+            });
+        }
 
         ifstream configfilestream(config_file);
 
@@ -416,7 +1077,8 @@ int main(int argc, char const *argv[]) {
         return 0;
     }
 
+    balance_reporter.start([](balancereport::Key key){ return account_ids.name(key); });
     DEBUG_INFO("Waiting for connections");
     server = message_base::MessageBaseServer(server_id,sinfo);
-    server.server_start(server_recv_worker);
+    server.server_start(server_on_frame, server_on_close);
 }
\ No newline at end of file